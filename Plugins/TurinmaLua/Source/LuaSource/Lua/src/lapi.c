@@ -1332,6 +1332,25 @@ void lua_setwarnf (lua_State *L, lua_WarnFunction f, void *ud) {
 }
 
 
+/*
+** Not locked: the hooks being replaced are the ones that would be used,
+** so this must be called before the state is shared between threads.
+*/
+LUA_API void lua_setlockf (lua_State *L, lua_LockFunction lockf,
+                           lua_LockFunction unlockf, void *ud) {
+  global_State *g = G(L);
+  api_check(L, (lockf == NULL) == (unlockf == NULL), "lock hooks must come in pairs");
+  g->ud_lock = ud;
+  g->lockf = lockf;
+  g->unlockf = unlockf;
+}
+
+
+LUA_API void *lua_getlockud (lua_State *L) {
+  return G(L)->ud_lock;
+}
+
+
 void lua_warning (lua_State *L, const char *msg, int tocont) {
   lua_lock(L);
   luaE_warning(L, msg, tocont);
@@ -255,17 +255,21 @@ typedef l_uint32 Instruction;
 #define LUAI_MAXCCALLS		200
 #endif
 
-typedef void(*tlua_lockcb)(lua_State* L);
-extern tlua_lockcb glua_lockcb;
-extern tlua_lockcb glua_unlockcb;
-
 /*
 ** macros that are executed whenever program enters the Lua core
-** ('lua_lock') and leaves the core ('lua_unlock')
+** ('lua_lock') and leaves the core ('lua_unlock'). The hooks live in
+** 'global_State' (see 'lua_setlockf'), so each state chooses its own
+** locking; states without hooks only pay a test. Define
+** LUA_NOLOCKHOOKS to compile them out entirely.
 */
 #if !defined(lua_lock)
-#define lua_lock(L)	glua_lockcb(L)
-#define lua_unlock(L) glua_unlockcb(L)
+#if defined(LUA_NOLOCKHOOKS)
+#define lua_lock(L)	((void)0)
+#define lua_unlock(L)	((void)0)
+#else
+#define lua_lock(L)	(G(L)->lockf ? G(L)->lockf(L) : (void)0)
+#define lua_unlock(L)	(G(L)->unlockf ? G(L)->unlockf(L) : (void)0)
+#endif
 #endif
 
 /*
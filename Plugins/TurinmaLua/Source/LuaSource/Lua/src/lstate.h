@@ -300,6 +300,9 @@ typedef struct global_State {
   TString *strcache[STRCACHE_N][STRCACHE_M];  /* cache for strings in API */
   lua_WarnFunction warnf;  /* warning function */
   void *ud_warn;         /* auxiliary data to 'warnf' */
+  lua_LockFunction lockf;  /* called when entering the core, may be NULL */
+  lua_LockFunction unlockf;  /* called when leaving the core, may be NULL */
+  void *ud_lock;         /* auxiliary data to 'lockf'/'unlockf' */
 } global_State;
 
 
@@ -131,6 +131,12 @@ typedef void * (*lua_Alloc) (void *ud, void *ptr, size_t osize, size_t nsize);
 typedef void (*lua_WarnFunction) (void *ud, const char *msg, int tocont);
 
 
+/*
+** Type for functions called when entering/leaving the core of a state
+*/
+typedef void (*lua_LockFunction) (lua_State *L);
+
+
 /*
 ** Type used by the debug API to collect debug information
 */
@@ -323,6 +329,14 @@ LUA_API void (lua_setwarnf) (lua_State *L, lua_WarnFunction f, void *ud);
 LUA_API void (lua_warning)  (lua_State *L, const char *msg, int tocont);
 
 
+/*
+** Lock-related functions
+*/
+LUA_API void (lua_setlockf) (lua_State *L, lua_LockFunction lockf,
+                             lua_LockFunction unlockf, void *ud);
+LUA_API void *(lua_getlockud) (lua_State *L);
+
+
 /*
 ** garbage-collection function and options
 */
@@ -57,6 +57,11 @@ public class LuaSource : ModuleRules
         PublicDependencyModuleNames.AddRange(new string[] { "Core" });
 
         
+        if (Target.bBuildEditor)
+        {
+            PrivateDependencyModuleNames.Add("DirectoryWatcher");
+        }
+
         bEnableUndefinedIdentifierWarnings = false;
 
         if (Target.Platform == UnrealTargetPlatform.Win64)
@@ -1,4 +1,5 @@
 #include "CustomMemoryHandle.h"
+#include <algorithm>
 
 
 
@@ -69,94 +70,333 @@ KFSpinMutex& FCustomMemoryHandleBase::ItemMutex()
 }
 #endif
 
-long long& FCustomMemoryHandleBase::CurrentCheckId()
-{
-	static long long InnerCurrentCheckId = 0;
-	return InnerCurrentCheckId;
-}
-
 std::unordered_map<const FCustomMemoryItemBase*, FNewCustormMemoryIdPair>& FCustomMemoryHandleBase::NewCustomMemoryItemMap()
 {
 	static std::unordered_map<const FCustomMemoryItemBase*, FNewCustormMemoryIdPair> InnerMap;
 	return InnerMap;
 }
 
-std::list<FCustomMemoryHandleBase::FCustormMemoryPtrPair>& FCustomMemoryHandleBase::NewCustomMemoryItemPtrs()
+//Global slot storage of FCustomMemoryHandleBase.
+//Slots live in fixed size chunks that are never moved or freed, so a handle can keep a raw slot pointer.
+//Free slots are kept in per thread caches backed by one lock free stack, and every thread takes check ids
+//in blocks, so assign/unsign only touch shared atomics once per cache refill or flush.
+struct FCustomMemorySlotTable
 {
-	static std::list<FCustomMemoryHandleBase::FCustormMemoryPtrPair> InnerList;
-	return InnerList;
-}
+	using FSlot = FCustomMemoryHandleBase::FCustormMemoryPtrPair;
 
-std::vector<FCustomMemoryHandleBase::FCustormMemoryPtrPair*>& FCustomMemoryHandleBase::NewUnusedIndices()
-{
-	static std::vector<FCustomMemoryHandleBase::FCustormMemoryPtrPair*> InnerVector;
-	return InnerVector;
-}
+	static constexpr unsigned int ChunkBits = 14;
+	static constexpr unsigned int ChunkSize = 1u << ChunkBits;
+	static constexpr unsigned int MaxChunks = 8192;
+	static constexpr int CacheCapacity = 64;
+	static constexpr long long CheckIdBlockSize = 1024;
+
+	//trivially destructible so it can still be used by items destroyed after the thread's flusher ran
+	struct FThreadCache
+	{
+		FSlot* Slots[CacheCapacity];
+		int Num;
+		long long NextCheckId;
+		long long EndCheckId;
+		std::vector<FSlot*>* BatchSlots; //set while a FCustomMemoryAssignBatch is alive, taken from the back
+		std::vector<FSlot*>* PendingRelease; //set while a FCustomMemoryUnsignBatch is alive
+		bool bFlushed;
+	};
+
+	struct FThreadCacheFlusher
+	{
+		FThreadCache& Cache;
+		~FThreadCacheFlusher()
+		{
+			Get().PushFree(Cache.Slots, Cache.Num);
+			Cache.Num = 0;
+			Cache.bFlushed = true;
+		}
+	};
+
+	std::atomic<FSlot*> Chunks[MaxChunks] = {};
+	std::atomic<unsigned int> NumSlots{ 0 };
+	std::atomic<unsigned long long> FreeHead{ 0 }; //high 32 bits: aba tag, low 32 bits: index + 1 of the top slot
+	std::atomic<long long> NextCheckIdBlock{ 0 };
 
+	static FCustomMemorySlotTable& Get()
+	{
+		//never destroyed, items in other static objects may still unsign during shutdown
+		static FCustomMemorySlotTable* Inner = new FCustomMemorySlotTable();
+		return *Inner;
+	}
+
+	static FThreadCache& LocalCache()
+	{
+		static thread_local FThreadCache Inner = {};
+		static thread_local FThreadCacheFlusher Flusher{ Inner };
+		return Inner;
+	}
+
+	FSlot* SlotAt(unsigned int Index)
+	{
+		return Chunks[Index >> ChunkBits].load(std::memory_order_acquire) + (Index & (ChunkSize - 1));
+	}
+
+	void EnsureChunk(unsigned int ChunkIndex)
+	{
+		check_kf(ChunkIndex < MaxChunks);
+		if (Chunks[ChunkIndex].load(std::memory_order_acquire))
+		{
+			return;
+		}
 #if !KF_VALID_SERVER
+		std::lock_guard<KFSpinMutex> Lock(FCustomMemoryHandleBase::ItemMutex());
+#endif
+		if (!Chunks[ChunkIndex].load(std::memory_order_relaxed))
+		{
+			FSlot* Chunk = new FSlot[ChunkSize];
+			for (unsigned int i = 0; i < ChunkSize; ++i)
+			{
+				Chunk[i].SlotIndex = (ChunkIndex << ChunkBits) + i;
+			}
+			Chunks[ChunkIndex].store(Chunk, std::memory_order_release);
+		}
+	}
+
+	FSlot* PopFree()
+	{
+		unsigned long long Head = FreeHead.load(std::memory_order_acquire);
+		while (Head & 0xffffffffull)
+		{
+			FSlot* Slot = SlotAt((unsigned int)(Head & 0xffffffffull) - 1);
+			const unsigned long long NewHead = (((Head >> 32) + 1) << 32) | Slot->NextFree.load(std::memory_order_relaxed);
+			if (FreeHead.compare_exchange_weak(Head, NewHead, std::memory_order_acquire, std::memory_order_acquire))
+			{
+				return Slot;
+			}
+		}
+		return nullptr;
+	}
+
+	//links the slots together and publishes them with a single cas
+	void PushFree(FSlot* const* Slots, int Num)
+	{
+		if (Num <= 0)
+		{
+			return;
+		}
+		for (int i = 0; i + 1 < Num; ++i)
+		{
+			Slots[i]->NextFree.store(Slots[i + 1]->SlotIndex + 1, std::memory_order_relaxed);
+		}
+		unsigned long long Head = FreeHead.load(std::memory_order_relaxed);
+		unsigned long long NewHead;
+		do
+		{
+			Slots[Num - 1]->NextFree.store((unsigned int)(Head & 0xffffffffull), std::memory_order_relaxed);
+			NewHead = (((Head >> 32) + 1) << 32) | (Slots[0]->SlotIndex + 1);
+		} while (!FreeHead.compare_exchange_weak(Head, NewHead, std::memory_order_release, std::memory_order_relaxed));
+	}
+
+	void Refill(FThreadCache& Cache)
+	{
+		while (Cache.Num < CacheCapacity / 2)
+		{
+			FSlot* Slot = PopFree();
+			if (!Slot)
+			{
+				break;
+			}
+			Cache.Slots[Cache.Num++] = Slot;
+		}
+		if (Cache.Num > 0)
+		{
+			return;
+		}
+
+		//nothing to reuse, take a run of fresh slots so neighbouring slots stay on the same thread
+		const unsigned int Count = CacheCapacity / 2;
+		const unsigned int First = TakeFresh(Count);
+		for (unsigned int i = Count; i-- > 0;)
+		{
+			Cache.Slots[Cache.Num++] = SlotAt(First + i);
+		}
+	}
+
+	unsigned int TakeFresh(unsigned int Count)
+	{
+		const unsigned int First = NumSlots.fetch_add(Count, std::memory_order_relaxed);
+		for (unsigned int ChunkIndex = First >> ChunkBits; ChunkIndex <= (First + Count - 1) >> ChunkBits; ++ChunkIndex)
+		{
+			EnsureChunk(ChunkIndex);
+		}
+		return First;
+	}
+
+	void TakeCheckIds(FThreadCache& Cache, long long Count)
+	{
+		Cache.NextCheckId = NextCheckIdBlock.fetch_add(Count, std::memory_order_relaxed);
+		Cache.EndCheckId = Cache.NextCheckId + Count;
+	}
+
+	//ids are only unique within the block a thread took, so every id handed out is checked against its end
+	long long TakeCheckId(FThreadCache& Cache)
+	{
+		if (Cache.NextCheckId >= Cache.EndCheckId)
+		{
+			TakeCheckIds(Cache, CheckIdBlockSize);
+		}
+		return Cache.NextCheckId++;
+	}
 
-FCustomMemoryHandleBase::FCustormMemoryPtrPair*& FCustomMemoryHandleBase::NewCurrentOperateIndex()
+	//free slots first and fresh ones only for the rest, so spawning in batches does not grow the table while slots are free
+	void Reserve(FThreadCache& Cache, std::vector<FSlot*>& OutSlots, unsigned int Num)
+	{
+		OutSlots.reserve(Num);
+		while (OutSlots.size() < Num && Cache.Num > 0)
+		{
+			OutSlots.push_back(Cache.Slots[--Cache.Num]);
+		}
+		while (OutSlots.size() < Num)
+		{
+			FSlot* Slot = PopFree();
+			if (!Slot)
+			{
+				break;
+			}
+			OutSlots.push_back(Slot);
+		}
+		if (OutSlots.size() < Num)
+		{
+			const unsigned int Count = Num - (unsigned int)OutSlots.size();
+			const unsigned int First = TakeFresh(Count);
+			for (unsigned int i = Count; i-- > 0;)
+			{
+				OutSlots.push_back(SlotAt(First + i));
+			}
+		}
+	}
+
+	FSlot* Acquire(long long& OutCheckId)
+	{
+		FThreadCache& Cache = LocalCache();
+		if (Cache.BatchSlots && !Cache.BatchSlots->empty())
+		{
+			//a nested batch or one larger than its reserve may have used up the ids taken for this one
+			OutCheckId = TakeCheckId(Cache);
+			FSlot* Slot = Cache.BatchSlots->back();
+			Cache.BatchSlots->pop_back();
+			return Slot;
+		}
+		if (Cache.Num == 0)
+		{
+			Refill(Cache);
+		}
+		if (Cache.bFlushed)
+		{
+			//thread is exiting, do not keep anything in the cache any more
+			PushFree(Cache.Slots, Cache.Num - 1);
+			Cache.Slots[0] = Cache.Slots[Cache.Num - 1];
+			Cache.Num = 1;
+		}
+		OutCheckId = TakeCheckId(Cache);
+		return Cache.Slots[--Cache.Num];
+	}
+
+	void Release(FSlot* Slot)
+	{
+		FThreadCache& Cache = LocalCache();
+		if (Cache.PendingRelease)
+		{
+			Cache.PendingRelease->push_back(Slot);
+			return;
+		}
+		if (Cache.bFlushed)
+		{
+			PushFree(&Slot, 1);
+			return;
+		}
+		if (Cache.Num == CacheCapacity)
+		{
+			//keep the most recently released half hot, give the rest back
+			PushFree(Cache.Slots, CacheCapacity / 2);
+			std::copy(Cache.Slots + CacheCapacity / 2, Cache.Slots + CacheCapacity, Cache.Slots);
+			Cache.Num = CacheCapacity / 2;
+		}
+		Cache.Slots[Cache.Num++] = Slot;
+	}
+};
+
+FCustomMemoryAssignBatch::FCustomMemoryAssignBatch(int Num)
 {
-	static FCustomMemoryHandleBase::FCustormMemoryPtrPair* Inner = nullptr;
-	return Inner;
+	auto& Table = FCustomMemorySlotTable::Get();
+	auto& Cache = FCustomMemorySlotTable::LocalCache();
+	if (Num <= 0)
+	{
+		return;
+	}
+	bReserved = true;
+	Table.Reserve(Cache, Slots, (unsigned int)Num);
+	OuterSlots = Cache.BatchSlots;
+	Cache.BatchSlots = &Slots;
+	if (Cache.EndCheckId - Cache.NextCheckId < Num)
+	{
+		Table.TakeCheckIds(Cache, std::max<long long>(Num, FCustomMemorySlotTable::CheckIdBlockSize));
+	}
 }
 
-#endif
+FCustomMemoryAssignBatch::~FCustomMemoryAssignBatch()
+{
+	if (!bReserved)
+	{
+		return;
+	}
+	auto& Cache = FCustomMemorySlotTable::LocalCache();
+	FCustomMemorySlotTable::Get().PushFree(Slots.data(), (int)Slots.size());
+	Cache.BatchSlots = OuterSlots;
+}
 
-void FCustomMemoryHandleBase::Assign(const FCustomMemoryItemBase* InItemBase)
+FCustomMemoryUnsignBatch::FCustomMemoryUnsignBatch()
 {
-#if !KF_VALID_SERVER
-	ItemMutex().lock();
-#endif
-	CurrentCheckId()++;
-	FCustormMemoryPtrPair* UnusedId = nullptr;
-	if(NewUnusedIndices().size() > 0)
+	auto& Cache = FCustomMemorySlotTable::LocalCache();
+	OuterPendingSlots = Cache.PendingRelease;
+	if (!OuterPendingSlots)
 	{
-		UnusedId = NewUnusedIndices().back();
-#if !KF_VALID_SERVER
-		NewCurrentOperateIndex() = UnusedId;
-#endif
-		NewUnusedIndices().pop_back();
+		Cache.PendingRelease = &PendingSlots;
 	}
-	else
+}
+
+FCustomMemoryUnsignBatch::~FCustomMemoryUnsignBatch()
+{
+	if (!OuterPendingSlots)
 	{
-		NewCustomMemoryItemPtrs().emplace_back();
-		UnusedId = &NewCustomMemoryItemPtrs().back();
-#if !KF_VALID_SERVER
-		NewCurrentOperateIndex() = UnusedId;
-#endif
-		//CustomMemoryItemPtrs().push_back(FCustormMemoryPtrPair());
+		FCustomMemorySlotTable::LocalCache().PendingRelease = nullptr;
+		FCustomMemorySlotTable::Get().PushFree(PendingSlots.data(), (int)PendingSlots.size());
 	}
+}
+
+void FCustomMemoryHandleBase::Assign(const FCustomMemoryItemBase* InItemBase)
+{
+	long long CheckId = -1;
+	FCustormMemoryPtrPair* UnusedId = FCustomMemorySlotTable::Get().Acquire(CheckId);
 	
 #if CHECK_ITEM_PAIR
+	std::lock_guard<KFSpinMutex> Lock(ItemMutex());
 	FNewCustormMemoryIdPair& IdPair = NewCustomMemoryItemMap()[InItemBase];
 #else
 	FNewCustormMemoryIdPair IdPair;
 #endif
 	IdPair.PtrPair = UnusedId;
-	IdPair.CheckIndex = CurrentCheckId();
+	IdPair.CheckIndex = CheckId;
 	InItemBase->NewCustomMemoryPair.CopyFrom(IdPair);
-	InItemBase->checkid = 0xffffffff;
-	UnusedId->CheckIndex = CurrentCheckId();
-	UnusedId->ItemBase = const_cast<FCustomMemoryItemBase*>(InItemBase);
-#if !KF_VALID_SERVER
-	NewCurrentOperateIndex() = nullptr;
-	ItemMutex().unlock();
-#endif
+	InItemBase->checkid.store(0xffffffff, std::memory_order_relaxed);
+	UnusedId->CheckIndex.store(CheckId, std::memory_order_release);
 }
 
 void FCustomMemoryHandleBase::Unsign(const FCustomMemoryItemBase* InItemBase)
 {
-#if !KF_VALID_SERVER
-	ItemMutex().lock();
-#endif
-	
 #if !UE_BUILD_SHIPPING && !KF_VALID_SERVER
 	checkf(InItemBase, TEXT("InItemBase should not be null"));
-	checkf(InItemBase->checkid == 0xffffffff, TEXT("InItemBase Object: invalid checkid %d"), InItemBase->checkid);
+	checkf(InItemBase->checkid.load(std::memory_order_relaxed) == 0xffffffff, TEXT("InItemBase Object: invalid checkid %d"), InItemBase->checkid.load(std::memory_order_relaxed));
 #endif
 
 #if CHECK_ITEM_PAIR
+	std::lock_guard<KFSpinMutex> Lock(ItemMutex());
 	auto It = NewCustomMemoryItemMap().find(InItemBase);
 #endif
 
@@ -166,29 +406,21 @@ void FCustomMemoryHandleBase::Unsign(const FCustomMemoryItemBase* InItemBase)
 #endif
 #endif
 	
-	InItemBase->checkid = 0x00000000;
+	InItemBase->checkid.store(0x00000000, std::memory_order_relaxed);
 
 	FNewCustormMemoryIdPair& IdPair = InItemBase->NewCustomMemoryPair;
-#if !KF_VALID_SERVER
-	NewCurrentOperateIndex() = reinterpret_cast<FCustormMemoryPtrPair*>(IdPair.PtrPair);
-#endif
 	
 #if CHECK_ITEM_PAIR
 	checkf(It->second.CheckIndex == IdPair.CheckIndex && It->second.PtrPair == IdPair.PtrPair, TEXT("ItemPair not match"));
 #endif
 	auto* PairPtr = reinterpret_cast<FCustormMemoryPtrPair*>(IdPair.PtrPair);
-	PairPtr->CheckIndex = -1;
-	PairPtr->ItemBase = nullptr;
-	NewUnusedIndices().push_back(PairPtr);
+	PairPtr->CheckIndex.store(-1, std::memory_order_release);
+	FCustomMemorySlotTable::Get().Release(PairPtr);
 #if CHECK_ITEM_PAIR
 	NewCustomMemoryItemMap().erase(It);
 #endif
 	IdPair.CheckIndex = -1;
 	IdPair.PtrPair = nullptr;
-#if !KF_VALID_SERVER
-	NewCurrentOperateIndex() = nullptr;
-	ItemMutex().unlock();
-#endif
 }
 
 FCustomMemoryItemBase::FCustomMemoryItemBase()
@@ -0,0 +1,1068 @@
+// Copyright Epic Games, Inc. All Rights Reserved.
+
+#include "LuaMath.h"
+#include "LuaSource.h"
+#include "UObject/Class.h"
+
+EXTERN_C {
+#include "lobject.h"
+#include "lstate.h"
+}
+
+/* every function registered here is a closure over the metatables of all the types, in this order */
+enum ELuaMathType
+{
+    VectorType = 1,
+    RotatorType,
+    QuatType,
+    TransformType,
+    VectorArrayType,
+    NumLuaMathTypes = VectorArrayType,
+};
+
+static const char* const MathTypeNames[] = { "", "Vector", "Rotator", "Quat", "Transform", "VectorArray" };
+static const char* const MathMetatableNames[] =
+{
+    "",
+    MAKE_LUA_METATABLE_NAME(FVector),
+    MAKE_LUA_METATABLE_NAME(FRotator),
+    MAKE_LUA_METATABLE_NAME(FQuat),
+    MAKE_LUA_METATABLE_NAME(FTransform),
+    MAKE_LUA_METATABLE_NAME(FLuaVectorArray),
+};
+
+/* packed FVectors following the header in the same userdata */
+struct FLuaVectorArray
+{
+    int64 Num;
+
+    FVector* GetData() { return (FVector*)(this + 1); }
+};
+
+/* lua only guarantees pointer alignment for userdata memory, FQuat and FTransform want 16 */
+template<typename T>
+static T* AlignValue(void* Mem)
+{
+    return (T*)Align((uint8*)Mem, alignof(T));
+}
+
+static Table* GetTypeUpvalue(lua_State* L, int Type)
+{
+    return hvalue(&clCvalue(s2v(L->ci->func.p))->upvalue[Type - 1]);
+}
+
+template<typename T>
+static T* ToValue(lua_State* L, int Index, int Type)
+{
+    if (Index > lua_gettop(L))
+    {
+        return nullptr;
+    }
+    const TValue* Value = s2v(L->ci->func.p + Index);
+    if (!ttisfulluserdata(Value) || uvalue(Value)->metatable != GetTypeUpvalue(L, Type))
+    {
+        return nullptr;
+    }
+    return AlignValue<T>(getudatamem(uvalue(Value)));
+}
+
+/* the math types are trivially destructible, raising an error from here never skips a destructor */
+template<typename T>
+static T* CheckValue(lua_State* L, int Index, int Type)
+{
+    T* Value = ToValue<T>(L, Index, Type);
+    if (!Value)
+    {
+        luaL_typeerror(L, Index, MathTypeNames[Type]);
+    }
+    return Value;
+}
+
+template<typename T>
+static T* NewValue(lua_State* L, int Type)
+{
+    void* Mem = lua_newuserdatauv(L, sizeof(T) + alignof(T) - 1, 0);
+    lua_pushvalue(L, lua_upvalueindex(Type));
+    lua_setmetatable(L, -2);
+    return AlignValue<T>(Mem);
+}
+
+static FLuaVectorArray* NewVectorArray(lua_State* L, int64 Num)
+{
+    FLuaVectorArray* Array = (FLuaVectorArray*)lua_newuserdatauv(L, sizeof(FLuaVectorArray) + Num * sizeof(FVector), 0);
+    lua_pushvalue(L, lua_upvalueindex(VectorArrayType));
+    lua_setmetatable(L, -2);
+    Array->Num = Num;
+    FMemory::Memzero(Array->GetData(), Num * sizeof(FVector));
+    return Array;
+}
+
+FORCEINLINE static VectorRegister4Double LoadVector(const FVector& Value)
+{
+    return VectorLoadFloat3_W0(&Value.X);
+}
+
+FORCEINLINE static void StoreVector(const VectorRegister4Double& Register, FVector& Value)
+{
+    VectorStoreFloat3(Register, &Value.X);
+}
+
+/* the field name at 2 if it is a string, so __index can switch on it before looking for a method */
+static const char* GetFieldName(lua_State* L)
+{
+    return lua_type(L, 2) == LUA_TSTRING ? lua_tostring(L, 2) : "";
+}
+
+/* methods share the metatable with the metamethods, which are not fields of the value */
+static int IndexMethod(lua_State* L, int Type)
+{
+    const char* Name = GetFieldName(L);
+    if (Name[0] == '_' && Name[1] == '_')
+    {
+        return 0;
+    }
+    lua_settop(L, 2);
+    lua_rawget(L, lua_upvalueindex(Type));
+    return 1;
+}
+
+//Vector
+
+static int VectorNew(lua_State* L)
+{
+    FVector* Value = NewValue<FVector>(L, VectorType);
+    *Value = FVector(luaL_optnumber(L, 1, 0.), luaL_optnumber(L, 2, 0.), luaL_optnumber(L, 3, 0.));
+    return 1;
+}
+
+static int VectorIndex(lua_State* L)
+{
+    const FVector* Value = CheckValue<FVector>(L, 1, VectorType);
+    const char* Name = GetFieldName(L);
+    if (Name[0] && !Name[1])
+    {
+        switch (Name[0])
+        {
+        case 'X': lua_pushnumber(L, Value->X); return 1;
+        case 'Y': lua_pushnumber(L, Value->Y); return 1;
+        case 'Z': lua_pushnumber(L, Value->Z); return 1;
+        default: break;
+        }
+    }
+    return IndexMethod(L, VectorType);
+}
+
+static int VectorNewIndex(lua_State* L)
+{
+    FVector* Value = CheckValue<FVector>(L, 1, VectorType);
+    const char* Name = GetFieldName(L);
+    if (Name[0] && !Name[1])
+    {
+        switch (Name[0])
+        {
+        case 'X': Value->X = luaL_checknumber(L, 3); return 0;
+        case 'Y': Value->Y = luaL_checknumber(L, 3); return 0;
+        case 'Z': Value->Z = luaL_checknumber(L, 3); return 0;
+        default: break;
+        }
+    }
+    return luaL_error(L, "Vector has no field %s", Name);
+}
+
+static int VectorAdd(lua_State* L)
+{
+    const FVector* A = CheckValue<FVector>(L, 1, VectorType);
+    const FVector* B = CheckValue<FVector>(L, 2, VectorType);
+    StoreVector(VectorAdd(LoadVector(*A), LoadVector(*B)), *NewValue<FVector>(L, VectorType));
+    return 1;
+}
+
+static int VectorSub(lua_State* L)
+{
+    const FVector* A = CheckValue<FVector>(L, 1, VectorType);
+    const FVector* B = CheckValue<FVector>(L, 2, VectorType);
+    StoreVector(VectorSubtract(LoadVector(*A), LoadVector(*B)), *NewValue<FVector>(L, VectorType));
+    return 1;
+}
+
+/* a vector or a number on either side, numbers are splatted into all lanes */
+static VectorRegister4Double CheckVectorOrNumber(lua_State* L, int Index)
+{
+    if (const FVector* Value = ToValue<FVector>(L, Index, VectorType))
+    {
+        return LoadVector(*Value);
+    }
+    int IsNum = 0;
+    const lua_Number Number = lua_tonumberx(L, Index, &IsNum);
+    if (!IsNum)
+    {
+        luaL_typeerror(L, Index, "Vector or number");
+    }
+    return VectorSetFloat1((double)Number);
+}
+
+static int VectorMul(lua_State* L)
+{
+    const VectorRegister4Double A = CheckVectorOrNumber(L, 1);
+    const VectorRegister4Double B = CheckVectorOrNumber(L, 2);
+    StoreVector(VectorMultiply(A, B), *NewValue<FVector>(L, VectorType));
+    return 1;
+}
+
+static int VectorDiv(lua_State* L)
+{
+    const VectorRegister4Double A = CheckVectorOrNumber(L, 1);
+    const VectorRegister4Double B = CheckVectorOrNumber(L, 2);
+    StoreVector(VectorDivide(A, B), *NewValue<FVector>(L, VectorType));
+    return 1;
+}
+
+static int VectorUnm(lua_State* L)
+{
+    const FVector* A = CheckValue<FVector>(L, 1, VectorType);
+    StoreVector(VectorNegate(LoadVector(*A)), *NewValue<FVector>(L, VectorType));
+    return 1;
+}
+
+/* lua calls __eq for any two userdata, a value of another type is simply not equal */
+static int VectorEq(lua_State* L)
+{
+    const FVector* A = ToValue<FVector>(L, 1, VectorType);
+    const FVector* B = ToValue<FVector>(L, 2, VectorType);
+    lua_pushboolean(L, A && B && *A == *B);
+    return 1;
+}
+
+static int VectorToString(lua_State* L)
+{
+    const FVector* A = CheckValue<FVector>(L, 1, VectorType);
+    lua_pushfstring(L, "X=%f Y=%f Z=%f", (lua_Number)A->X, (lua_Number)A->Y, (lua_Number)A->Z);
+    return 1;
+}
+
+static int VectorDot(lua_State* L)
+{
+    const FVector* A = CheckValue<FVector>(L, 1, VectorType);
+    const FVector* B = CheckValue<FVector>(L, 2, VectorType);
+    lua_pushnumber(L, VectorDot3Scalar(LoadVector(*A), LoadVector(*B)));
+    return 1;
+}
+
+static int VectorCross(lua_State* L)
+{
+    const FVector* A = CheckValue<FVector>(L, 1, VectorType);
+    const FVector* B = CheckValue<FVector>(L, 2, VectorType);
+    StoreVector(VectorCross(LoadVector(*A), LoadVector(*B)), *NewValue<FVector>(L, VectorType));
+    return 1;
+}
+
+static int VectorLerp(lua_State* L)
+{
+    const FVector* A = CheckValue<FVector>(L, 1, VectorType);
+    const FVector* B = CheckValue<FVector>(L, 2, VectorType);
+    const VectorRegister4Double Alpha = VectorSetFloat1((double)luaL_checknumber(L, 3));
+    const VectorRegister4Double From = LoadVector(*A);
+    StoreVector(VectorMultiplyAdd(VectorSubtract(LoadVector(*B), From), Alpha, From), *NewValue<FVector>(L, VectorType));
+    return 1;
+}
+
+static int VectorLength(lua_State* L)
+{
+    const FVector* A = CheckValue<FVector>(L, 1, VectorType);
+    lua_pushnumber(L, A->Length());
+    return 1;
+}
+
+static int VectorSizeSquared(lua_State* L)
+{
+    const FVector* A = CheckValue<FVector>(L, 1, VectorType);
+    const VectorRegister4Double Register = LoadVector(*A);
+    lua_pushnumber(L, VectorDot3Scalar(Register, Register));
+    return 1;
+}
+
+static int VectorGetSafeNormal(lua_State* L)
+{
+    const FVector* A = CheckValue<FVector>(L, 1, VectorType);
+    *NewValue<FVector>(L, VectorType) = A->GetSafeNormal();
+    return 1;
+}
+
+static int VectorCopy(lua_State* L)
+{
+    const FVector* A = CheckValue<FVector>(L, 1, VectorType);
+    *NewValue<FVector>(L, VectorType) = *A;
+    return 1;
+}
+
+static const luaL_Reg VectorFunctions[] =
+{
+    { "__index", VectorIndex },
+    { "__newindex", VectorNewIndex },
+    { "__add", VectorAdd },
+    { "__sub", VectorSub },
+    { "__mul", VectorMul },
+    { "__div", VectorDiv },
+    { "__unm", VectorUnm },
+    { "__eq", VectorEq },
+    { "__tostring", VectorToString },
+    { "Dot", VectorDot },
+    { "Cross", VectorCross },
+    { "Lerp", VectorLerp },
+    { "Length", VectorLength },
+    { "SizeSquared", VectorSizeSquared },
+    { "GetSafeNormal", VectorGetSafeNormal },
+    { "Copy", VectorCopy },
+    { nullptr, nullptr },
+};
+
+//Rotator
+
+static int RotatorNew(lua_State* L)
+{
+    FRotator* Value = NewValue<FRotator>(L, RotatorType);
+    *Value = FRotator(luaL_optnumber(L, 1, 0.), luaL_optnumber(L, 2, 0.), luaL_optnumber(L, 3, 0.));
+    return 1;
+}
+
+static int RotatorIndex(lua_State* L)
+{
+    const FRotator* Value = CheckValue<FRotator>(L, 1, RotatorType);
+    const char* Name = GetFieldName(L);
+    if (FCStringAnsi::Strcmp(Name, "Pitch") == 0)
+    {
+        lua_pushnumber(L, Value->Pitch);
+        return 1;
+    }
+    if (FCStringAnsi::Strcmp(Name, "Yaw") == 0)
+    {
+        lua_pushnumber(L, Value->Yaw);
+        return 1;
+    }
+    if (FCStringAnsi::Strcmp(Name, "Roll") == 0)
+    {
+        lua_pushnumber(L, Value->Roll);
+        return 1;
+    }
+    return IndexMethod(L, RotatorType);
+}
+
+static int RotatorNewIndex(lua_State* L)
+{
+    FRotator* Value = CheckValue<FRotator>(L, 1, RotatorType);
+    const char* Name = GetFieldName(L);
+    if (FCStringAnsi::Strcmp(Name, "Pitch") == 0)
+    {
+        Value->Pitch = luaL_checknumber(L, 3);
+        return 0;
+    }
+    if (FCStringAnsi::Strcmp(Name, "Yaw") == 0)
+    {
+        Value->Yaw = luaL_checknumber(L, 3);
+        return 0;
+    }
+    if (FCStringAnsi::Strcmp(Name, "Roll") == 0)
+    {
+        Value->Roll = luaL_checknumber(L, 3);
+        return 0;
+    }
+    return luaL_error(L, "Rotator has no field %s", Name);
+}
+
+static int RotatorAdd(lua_State* L)
+{
+    const FRotator* A = CheckValue<FRotator>(L, 1, RotatorType);
+    const FRotator* B = CheckValue<FRotator>(L, 2, RotatorType);
+    *NewValue<FRotator>(L, RotatorType) = *A + *B;
+    return 1;
+}
+
+static int RotatorSub(lua_State* L)
+{
+    const FRotator* A = CheckValue<FRotator>(L, 1, RotatorType);
+    const FRotator* B = CheckValue<FRotator>(L, 2, RotatorType);
+    *NewValue<FRotator>(L, RotatorType) = *A - *B;
+    return 1;
+}
+
+static int RotatorEq(lua_State* L)
+{
+    const FRotator* A = ToValue<FRotator>(L, 1, RotatorType);
+    const FRotator* B = ToValue<FRotator>(L, 2, RotatorType);
+    lua_pushboolean(L, A && B && *A == *B);
+    return 1;
+}
+
+static int RotatorToString(lua_State* L)
+{
+    const FRotator* A = CheckValue<FRotator>(L, 1, RotatorType);
+    lua_pushfstring(L, "P=%f Y=%f R=%f", (lua_Number)A->Pitch, (lua_Number)A->Yaw, (lua_Number)A->Roll);
+    return 1;
+}
+
+static int RotatorQuaternion(lua_State* L)
+{
+    const FRotator* A = CheckValue<FRotator>(L, 1, RotatorType);
+    *NewValue<FQuat>(L, QuatType) = A->Quaternion();
+    return 1;
+}
+
+static int RotatorRotateVector(lua_State* L)
+{
+    const FRotator* A = CheckValue<FRotator>(L, 1, RotatorType);
+    const FVector* V = CheckValue<FVector>(L, 2, VectorType);
+    *NewValue<FVector>(L, VectorType) = A->RotateVector(*V);
+    return 1;
+}
+
+static int RotatorUnrotateVector(lua_State* L)
+{
+    const FRotator* A = CheckValue<FRotator>(L, 1, RotatorType);
+    const FVector* V = CheckValue<FVector>(L, 2, VectorType);
+    *NewValue<FVector>(L, VectorType) = A->UnrotateVector(*V);
+    return 1;
+}
+
+static int RotatorVector(lua_State* L)
+{
+    const FRotator* A = CheckValue<FRotator>(L, 1, RotatorType);
+    *NewValue<FVector>(L, VectorType) = A->Vector();
+    return 1;
+}
+
+static int RotatorGetNormalized(lua_State* L)
+{
+    const FRotator* A = CheckValue<FRotator>(L, 1, RotatorType);
+    *NewValue<FRotator>(L, RotatorType) = A->GetNormalized();
+    return 1;
+}
+
+static const luaL_Reg RotatorFunctions[] =
+{
+    { "__index", RotatorIndex },
+    { "__newindex", RotatorNewIndex },
+    { "__add", RotatorAdd },
+    { "__sub", RotatorSub },
+    { "__eq", RotatorEq },
+    { "__tostring", RotatorToString },
+    { "Quaternion", RotatorQuaternion },
+    { "RotateVector", RotatorRotateVector },
+    { "UnrotateVector", RotatorUnrotateVector },
+    { "Vector", RotatorVector },
+    { "GetNormalized", RotatorGetNormalized },
+    { nullptr, nullptr },
+};
+
+//Quat
+
+static int QuatNew(lua_State* L)
+{
+    FQuat* Value = NewValue<FQuat>(L, QuatType);
+    if (const FRotator* Rotator = ToValue<FRotator>(L, 1, RotatorType))
+    {
+        *Value = Rotator->Quaternion();
+    }
+    else if (lua_isnoneornil(L, 1))
+    {
+        *Value = FQuat::Identity;
+    }
+    else
+    {
+        *Value = FQuat(luaL_checknumber(L, 1), luaL_checknumber(L, 2), luaL_checknumber(L, 3), luaL_checknumber(L, 4));
+    }
+    return 1;
+}
+
+static int QuatIndex(lua_State* L)
+{
+    const FQuat* Value = CheckValue<FQuat>(L, 1, QuatType);
+    const char* Name = GetFieldName(L);
+    if (Name[0] && !Name[1])
+    {
+        switch (Name[0])
+        {
+        case 'X': lua_pushnumber(L, Value->X); return 1;
+        case 'Y': lua_pushnumber(L, Value->Y); return 1;
+        case 'Z': lua_pushnumber(L, Value->Z); return 1;
+        case 'W': lua_pushnumber(L, Value->W); return 1;
+        default: break;
+        }
+    }
+    return IndexMethod(L, QuatType);
+}
+
+static int QuatNewIndex(lua_State* L)
+{
+    FQuat* Value = CheckValue<FQuat>(L, 1, QuatType);
+    const char* Name = GetFieldName(L);
+    if (Name[0] && !Name[1])
+    {
+        switch (Name[0])
+        {
+        case 'X': Value->X = luaL_checknumber(L, 3); return 0;
+        case 'Y': Value->Y = luaL_checknumber(L, 3); return 0;
+        case 'Z': Value->Z = luaL_checknumber(L, 3); return 0;
+        case 'W': Value->W = luaL_checknumber(L, 3); return 0;
+        default: break;
+        }
+    }
+    return luaL_error(L, "Quat has no field %s", Name);
+}
+
+/* quat * quat composes, quat * vector rotates the vector */
+static int QuatMul(lua_State* L)
+{
+    const FQuat* A = CheckValue<FQuat>(L, 1, QuatType);
+    if (const FVector* V = ToValue<FVector>(L, 2, VectorType))
+    {
+        *NewValue<FVector>(L, VectorType) = A->RotateVector(*V);
+        return 1;
+    }
+    const FQuat* B = CheckValue<FQuat>(L, 2, QuatType);
+    *NewValue<FQuat>(L, QuatType) = *A * *B;
+    return 1;
+}
+
+static int QuatEq(lua_State* L)
+{
+    const FQuat* A = ToValue<FQuat>(L, 1, QuatType);
+    const FQuat* B = ToValue<FQuat>(L, 2, QuatType);
+    lua_pushboolean(L, A && B && A->X == B->X && A->Y == B->Y && A->Z == B->Z && A->W == B->W);
+    return 1;
+}
+
+static int QuatToString(lua_State* L)
+{
+    const FQuat* A = CheckValue<FQuat>(L, 1, QuatType);
+    lua_pushfstring(L, "X=%f Y=%f Z=%f W=%f", (lua_Number)A->X, (lua_Number)A->Y, (lua_Number)A->Z, (lua_Number)A->W);
+    return 1;
+}
+
+static int QuatRotateVector(lua_State* L)
+{
+    const FQuat* A = CheckValue<FQuat>(L, 1, QuatType);
+    const FVector* V = CheckValue<FVector>(L, 2, VectorType);
+    *NewValue<FVector>(L, VectorType) = A->RotateVector(*V);
+    return 1;
+}
+
+static int QuatUnrotateVector(lua_State* L)
+{
+    const FQuat* A = CheckValue<FQuat>(L, 1, QuatType);
+    const FVector* V = CheckValue<FVector>(L, 2, VectorType);
+    *NewValue<FVector>(L, VectorType) = A->UnrotateVector(*V);
+    return 1;
+}
+
+static int QuatInverse(lua_State* L)
+{
+    const FQuat* A = CheckValue<FQuat>(L, 1, QuatType);
+    *NewValue<FQuat>(L, QuatType) = A->Inverse();
+    return 1;
+}
+
+static int QuatRotator(lua_State* L)
+{
+    const FQuat* A = CheckValue<FQuat>(L, 1, QuatType);
+    *NewValue<FRotator>(L, RotatorType) = A->Rotator();
+    return 1;
+}
+
+static int QuatGetNormalized(lua_State* L)
+{
+    const FQuat* A = CheckValue<FQuat>(L, 1, QuatType);
+    *NewValue<FQuat>(L, QuatType) = A->GetNormalized();
+    return 1;
+}
+
+static int QuatSlerp(lua_State* L)
+{
+    const FQuat* A = CheckValue<FQuat>(L, 1, QuatType);
+    const FQuat* B = CheckValue<FQuat>(L, 2, QuatType);
+    *NewValue<FQuat>(L, QuatType) = FQuat::Slerp(*A, *B, luaL_checknumber(L, 3));
+    return 1;
+}
+
+static const luaL_Reg QuatFunctions[] =
+{
+    { "__index", QuatIndex },
+    { "__newindex", QuatNewIndex },
+    { "__mul", QuatMul },
+    { "__eq", QuatEq },
+    { "__tostring", QuatToString },
+    { "RotateVector", QuatRotateVector },
+    { "UnrotateVector", QuatUnrotateVector },
+    { "Inverse", QuatInverse },
+    { "Rotator", QuatRotator },
+    { "GetNormalized", QuatGetNormalized },
+    { "Slerp", QuatSlerp },
+    { nullptr, nullptr },
+};
+
+//Transform
+
+/* a rotation argument may be either a Quat or a Rotator */
+static FQuat OptRotation(lua_State* L, int Index)
+{
+    if (const FQuat* Quat = ToValue<FQuat>(L, Index, QuatType))
+    {
+        return *Quat;
+    }
+    if (const FRotator* Rotator = ToValue<FRotator>(L, Index, RotatorType))
+    {
+        return Rotator->Quaternion();
+    }
+    if (!lua_isnoneornil(L, Index))
+    {
+        luaL_typeerror(L, Index, "Quat or Rotator");
+    }
+    return FQuat::Identity;
+}
+
+static FVector OptVector(lua_State* L, int Index, const FVector& Default)
+{
+    if (lua_isnoneornil(L, Index))
+    {
+        return Default;
+    }
+    return *CheckValue<FVector>(L, Index, VectorType);
+}
+
+static int TransformNew(lua_State* L)
+{
+    const FQuat Rotation = OptRotation(L, 1);
+    const FVector Translation = OptVector(L, 2, FVector::ZeroVector);
+    const FVector Scale = OptVector(L, 3, FVector::OneVector);
+    new (NewValue<FTransform>(L, TransformType)) FTransform(Rotation, Translation, Scale);
+    return 1;
+}
+
+static int TransformIndex(lua_State* L)
+{
+    CheckValue<FTransform>(L, 1, TransformType);
+    return IndexMethod(L, TransformType);
+}
+
+/* A * B applies A first and then B, same as FTransform */
+static int TransformMul(lua_State* L)
+{
+    const FTransform* A = CheckValue<FTransform>(L, 1, TransformType);
+    const FTransform* B = CheckValue<FTransform>(L, 2, TransformType);
+    FTransform* Result = NewValue<FTransform>(L, TransformType);
+    FTransform::Multiply(Result, A, B);
+    return 1;
+}
+
+static int TransformToString(lua_State* L)
+{
+    const FTransform* A = CheckValue<FTransform>(L, 1, TransformType);
+    lua_pushstring(L, TCHAR_TO_UTF8(*A->ToHumanReadableString()));
+    return 1;
+}
+
+static int TransformTransformPosition(lua_State* L)
+{
+    const FTransform* A = CheckValue<FTransform>(L, 1, TransformType);
+    const FVector* V = CheckValue<FVector>(L, 2, VectorType);
+    *NewValue<FVector>(L, VectorType) = A->TransformPosition(*V);
+    return 1;
+}
+
+static int TransformTransformVector(lua_State* L)
+{
+    const FTransform* A = CheckValue<FTransform>(L, 1, TransformType);
+    const FVector* V = CheckValue<FVector>(L, 2, VectorType);
+    *NewValue<FVector>(L, VectorType) = A->TransformVector(*V);
+    return 1;
+}
+
+static int TransformInverseTransformPosition(lua_State* L)
+{
+    const FTransform* A = CheckValue<FTransform>(L, 1, TransformType);
+    const FVector* V = CheckValue<FVector>(L, 2, VectorType);
+    *NewValue<FVector>(L, VectorType) = A->InverseTransformPosition(*V);
+    return 1;
+}
+
+static int TransformInverseTransformVector(lua_State* L)
+{
+    const FTransform* A = CheckValue<FTransform>(L, 1, TransformType);
+    const FVector* V = CheckValue<FVector>(L, 2, VectorType);
+    *NewValue<FVector>(L, VectorType) = A->InverseTransformVector(*V);
+    return 1;
+}
+
+static int TransformInverse(lua_State* L)
+{
+    const FTransform* A = CheckValue<FTransform>(L, 1, TransformType);
+    new (NewValue<FTransform>(L, TransformType)) FTransform(A->Inverse());
+    return 1;
+}
+
+static int TransformGetLocation(lua_State* L)
+{
+    const FTransform* A = CheckValue<FTransform>(L, 1, TransformType);
+    *NewValue<FVector>(L, VectorType) = A->GetLocation();
+    return 1;
+}
+
+static int TransformGetRotation(lua_State* L)
+{
+    const FTransform* A = CheckValue<FTransform>(L, 1, TransformType);
+    *NewValue<FQuat>(L, QuatType) = A->GetRotation();
+    return 1;
+}
+
+static int TransformGetScale3D(lua_State* L)
+{
+    const FTransform* A = CheckValue<FTransform>(L, 1, TransformType);
+    *NewValue<FVector>(L, VectorType) = A->GetScale3D();
+    return 1;
+}
+
+static int TransformSetLocation(lua_State* L)
+{
+    FTransform* A = CheckValue<FTransform>(L, 1, TransformType);
+    A->SetLocation(*CheckValue<FVector>(L, 2, VectorType));
+    return 0;
+}
+
+static int TransformSetRotation(lua_State* L)
+{
+    FTransform* A = CheckValue<FTransform>(L, 1, TransformType);
+    A->SetRotation(OptRotation(L, 2));
+    return 0;
+}
+
+static int TransformSetScale3D(lua_State* L)
+{
+    FTransform* A = CheckValue<FTransform>(L, 1, TransformType);
+    A->SetScale3D(*CheckValue<FVector>(L, 2, VectorType));
+    return 0;
+}
+
+static const luaL_Reg TransformFunctions[] =
+{
+    { "__index", TransformIndex },
+    { "__mul", TransformMul },
+    { "__tostring", TransformToString },
+    { "TransformPosition", TransformTransformPosition },
+    { "TransformVector", TransformTransformVector },
+    { "InverseTransformPosition", TransformInverseTransformPosition },
+    { "InverseTransformVector", TransformInverseTransformVector },
+    { "Inverse", TransformInverse },
+    { "GetLocation", TransformGetLocation },
+    { "GetRotation", TransformGetRotation },
+    { "GetScale3D", TransformGetScale3D },
+    { "SetLocation", TransformSetLocation },
+    { "SetRotation", TransformSetRotation },
+    { "SetScale3D", TransformSetScale3D },
+    { nullptr, nullptr },
+};
+
+//VectorArray, the batch operations work on every element in place in one call
+
+static int VectorArrayNew(lua_State* L)
+{
+    if (lua_istable(L, 1))
+    {
+        const lua_Integer Num = luaL_len(L, 1);
+        FLuaVectorArray* Array = NewVectorArray(L, Num);//array
+        for (lua_Integer Index = 1; Index <= Num; ++Index)
+        {
+            lua_rawgeti(L, 1, Index);//array, element
+            Array->GetData()[Index - 1] = *CheckValue<FVector>(L, lua_gettop(L), VectorType);
+            lua_pop(L, 1);//array
+        }
+        return 1;
+    }
+    const lua_Integer Num = luaL_checkinteger(L, 1);
+    luaL_argcheck(L, Num >= 0 && Num <= (lua_Integer)(MAX_int32), 1, "invalid size");
+    NewVectorArray(L, Num);
+    return 1;
+}
+
+static int64 CheckArrayIndex(lua_State* L, FLuaVectorArray* Array)
+{
+    const lua_Integer Index = luaL_checkinteger(L, 2);
+    luaL_argcheck(L, Index >= 1 && Index <= Array->Num, 2, "index out of range");
+    return Index - 1;
+}
+
+static int VectorArrayIndex(lua_State* L)
+{
+    FLuaVectorArray* Array = CheckValue<FLuaVectorArray>(L, 1, VectorArrayType);
+    if (lua_type(L, 2) == LUA_TNUMBER)
+    {
+        const int64 Index = CheckArrayIndex(L, Array);
+        *NewValue<FVector>(L, VectorType) = Array->GetData()[Index];
+        return 1;
+    }
+    return IndexMethod(L, VectorArrayType);
+}
+
+static int VectorArrayNewIndex(lua_State* L)
+{
+    FLuaVectorArray* Array = CheckValue<FLuaVectorArray>(L, 1, VectorArrayType);
+    const int64 Index = CheckArrayIndex(L, Array);
+    Array->GetData()[Index] = *CheckValue<FVector>(L, 3, VectorType);
+    return 0;
+}
+
+static int VectorArrayLen(lua_State* L)
+{
+    lua_pushinteger(L, CheckValue<FLuaVectorArray>(L, 1, VectorArrayType)->Num);
+    return 1;
+}
+
+static int VectorArrayFill(lua_State* L)
+{
+    FLuaVectorArray* Array = CheckValue<FLuaVectorArray>(L, 1, VectorArrayType);
+    const FVector Value = *CheckValue<FVector>(L, 2, VectorType);
+    FVector* Data = Array->GetData();
+    for (int64 Index = 0; Index < Array->Num; ++Index)
+    {
+        Data[Index] = Value;
+    }
+    return 0;
+}
+
+static int VectorArrayAddVector(lua_State* L)
+{
+    FLuaVectorArray* Array = CheckValue<FLuaVectorArray>(L, 1, VectorArrayType);
+    const VectorRegister4Double Offset = LoadVector(*CheckValue<FVector>(L, 2, VectorType));
+    FVector* Data = Array->GetData();
+    for (int64 Index = 0; Index < Array->Num; ++Index)
+    {
+        StoreVector(VectorAdd(LoadVector(Data[Index]), Offset), Data[Index]);
+    }
+    return 0;
+}
+
+static int VectorArrayScale(lua_State* L)
+{
+    FLuaVectorArray* Array = CheckValue<FLuaVectorArray>(L, 1, VectorArrayType);
+    const VectorRegister4Double Scale = CheckVectorOrNumber(L, 2);
+    FVector* Data = Array->GetData();
+    for (int64 Index = 0; Index < Array->Num; ++Index)
+    {
+        StoreVector(VectorMultiply(LoadVector(Data[Index]), Scale), Data[Index]);
+    }
+    return 0;
+}
+
+/* move every element towards the element of Target with the same index */
+static int VectorArrayLerpTo(lua_State* L)
+{
+    FLuaVectorArray* Array = CheckValue<FLuaVectorArray>(L, 1, VectorArrayType);
+    FLuaVectorArray* Target = CheckValue<FLuaVectorArray>(L, 2, VectorArrayType);
+    luaL_argcheck(L, Target->Num == Array->Num, 2, "sizes differ");
+    const VectorRegister4Double Alpha = VectorSetFloat1((double)luaL_checknumber(L, 3));
+    FVector* Data = Array->GetData();
+    const FVector* TargetData = Target->GetData();
+    for (int64 Index = 0; Index < Array->Num; ++Index)
+    {
+        const VectorRegister4Double From = LoadVector(Data[Index]);
+        StoreVector(VectorMultiplyAdd(VectorSubtract(LoadVector(TargetData[Index]), From), Alpha, From), Data[Index]);
+    }
+    return 0;
+}
+
+static int VectorArrayTransformPositions(lua_State* L)
+{
+    FLuaVectorArray* Array = CheckValue<FLuaVectorArray>(L, 1, VectorArrayType);
+    const FTransform* Transform = CheckValue<FTransform>(L, 2, TransformType);
+    FVector* Data = Array->GetData();
+    for (int64 Index = 0; Index < Array->Num; ++Index)
+    {
+        Data[Index] = Transform->TransformPosition(Data[Index]);
+    }
+    return 0;
+}
+
+static int VectorArraySum(lua_State* L)
+{
+    FLuaVectorArray* Array = CheckValue<FLuaVectorArray>(L, 1, VectorArrayType);
+    VectorRegister4Double Sum = VectorZeroDouble();
+    const FVector* Data = Array->GetData();
+    for (int64 Index = 0; Index < Array->Num; ++Index)
+    {
+        Sum = VectorAdd(Sum, LoadVector(Data[Index]));
+    }
+    StoreVector(Sum, *NewValue<FVector>(L, VectorType));
+    return 1;
+}
+
+static const luaL_Reg VectorArrayFunctions[] =
+{
+    { "__index", VectorArrayIndex },
+    { "__newindex", VectorArrayNewIndex },
+    { "__len", VectorArrayLen },
+    { "Num", VectorArrayLen },
+    { "Fill", VectorArrayFill },
+    { "AddVector", VectorArrayAddVector },
+    { "Scale", VectorArrayScale },
+    { "LerpTo", VectorArrayLerpTo },
+    { "TransformPositions", VectorArrayTransformPositions },
+    { "Sum", VectorArraySum },
+    { nullptr, nullptr },
+};
+
+static const luaL_Reg UEMathFunctions[] =
+{
+    { "Vector", VectorNew },
+    { "Rotator", RotatorNew },
+    { "Quat", QuatNew },
+    { "Transform", TransformNew },
+    { "VectorArray", VectorArrayNew },
+    { "Dot", VectorDot },
+    { "Cross", VectorCross },
+    { "Lerp", VectorLerp },
+    { nullptr, nullptr },
+};
+
+static void PushTypeMetatables(lua_State* L, int FirstMetatable)
+{
+    for (int Type = 1; Type <= NumLuaMathTypes; ++Type)
+    {
+        lua_pushvalue(L, FirstMetatable + Type - 1);
+    }
+}
+
+void LuaMath::Register(lua_State* L)
+{
+    const luaL_Reg* const TypeFunctions[] = { nullptr, VectorFunctions, RotatorFunctions, QuatFunctions, TransformFunctions, VectorArrayFunctions };
+
+    const int FirstMetatable = lua_gettop(L) + 1;
+    for (int Type = 1; Type <= NumLuaMathTypes; ++Type)
+    {
+        luaL_newmetatable(L, MathMetatableNames[Type]);//mts...
+        lua_pushstring(L, MathTypeNames[Type]);
+        lua_setfield(L, -2, "__name");
+    }
+    for (int Type = 1; Type <= NumLuaMathTypes; ++Type)
+    {
+        lua_pushvalue(L, FirstMetatable + Type - 1);//mts..., mt
+        PushTypeMetatables(L, FirstMetatable);//mts..., mt, upvalues...
+        luaL_setfuncs(L, TypeFunctions[Type], NumLuaMathTypes);//mts..., mt
+        lua_pop(L, 1);//mts...
+    }
+
+    lua_newtable(L);//mts..., UEMath
+    PushTypeMetatables(L, FirstMetatable);//mts..., UEMath, upvalues...
+    luaL_setfuncs(L, UEMathFunctions, NumLuaMathTypes);//mts..., UEMath
+    lua_setglobal(L, "UEMath");//mts...
+    lua_settop(L, FirstMetatable - 1);
+}
+
+template<typename T>
+static T* PushNamedValue(lua_State* L, int Type)
+{
+    void* Mem = lua_newuserdatauv(L, sizeof(T) + alignof(T) - 1, 0);
+    luaL_setmetatable(L, MathMetatableNames[Type]);
+    return AlignValue<T>(Mem);
+}
+
+template<typename T>
+static T* ToNamedValue(lua_State* L, int Index, int Type)
+{
+    void* Mem = luaL_testudata(L, Index, MathMetatableNames[Type]);
+    return Mem ? AlignValue<T>(Mem) : nullptr;
+}
+
+void LuaMath::PushVector(lua_State* L, const FVector& Value)
+{
+    *PushNamedValue<FVector>(L, VectorType) = Value;
+}
+
+void LuaMath::PushRotator(lua_State* L, const FRotator& Value)
+{
+    *PushNamedValue<FRotator>(L, RotatorType) = Value;
+}
+
+void LuaMath::PushQuat(lua_State* L, const FQuat& Value)
+{
+    *PushNamedValue<FQuat>(L, QuatType) = Value;
+}
+
+void LuaMath::PushTransform(lua_State* L, const FTransform& Value)
+{
+    new (PushNamedValue<FTransform>(L, TransformType)) FTransform(Value);
+}
+
+FVector* LuaMath::ToVector(lua_State* L, int Index)
+{
+    return ToNamedValue<FVector>(L, Index, VectorType);
+}
+
+FRotator* LuaMath::ToRotator(lua_State* L, int Index)
+{
+    return ToNamedValue<FRotator>(L, Index, RotatorType);
+}
+
+FQuat* LuaMath::ToQuat(lua_State* L, int Index)
+{
+    return ToNamedValue<FQuat>(L, Index, QuatType);
+}
+
+FTransform* LuaMath::ToTransform(lua_State* L, int Index)
+{
+    return ToNamedValue<FTransform>(L, Index, TransformType);
+}
+
+bool LuaMath::PushStruct(lua_State* L, const UScriptStruct* Struct, const void* Value)
+{
+    if (Struct == TBaseStructure<FVector>::Get())
+    {
+        PushVector(L, *(const FVector*)Value);
+    }
+    else if (Struct == TBaseStructure<FRotator>::Get())
+    {
+        PushRotator(L, *(const FRotator*)Value);
+    }
+    else if (Struct == TBaseStructure<FQuat>::Get())
+    {
+        PushQuat(L, *(const FQuat*)Value);
+    }
+    else if (Struct == TBaseStructure<FTransform>::Get())
+    {
+        PushTransform(L, *(const FTransform*)Value);
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+template<typename T>
+static bool CopyValue(T* Source, void* Value)
+{
+    if (!Source)
+    {
+        return false;
+    }
+    *(T*)Value = *Source;
+    return true;
+}
+
+bool LuaMath::ToStruct(lua_State* L, int Index, const UScriptStruct* Struct, void* Value)
+{
+    if (Struct == TBaseStructure<FVector>::Get())
+    {
+        return CopyValue(ToVector(L, Index), Value);
+    }
+    if (Struct == TBaseStructure<FRotator>::Get())
+    {
+        return CopyValue(ToRotator(L, Index), Value);
+    }
+    if (Struct == TBaseStructure<FQuat>::Get())
+    {
+        return CopyValue(ToQuat(L, Index), Value);
+    }
+    if (Struct == TBaseStructure<FTransform>::Get())
+    {
+        return CopyValue(ToTransform(L, Index), Value);
+    }
+    return false;
+}
@@ -0,0 +1,175 @@
+// Copyright Epic Games, Inc. All Rights Reserved.
+
+#include "LuaScriptBundle.h"
+#include "lua.hpp"
+#include "HAL/FileManager.h"
+#include "Misc/FileHelper.h"
+#include "Misc/PackageName.h"
+#include "Misc/Paths.h"
+
+FString FLuaScriptBundle::GetDefaultPath()
+{
+    return FPaths::ProjectContentDir() / TEXT("LuaBundle/Scripts.tlsb");
+}
+
+TUniquePtr<FLuaScriptBundle> FLuaScriptBundle::Load(const FString& FileName)
+{
+    TUniquePtr<FLuaScriptBundle> Bundle = MakeUnique<FLuaScriptBundle>();
+    if (!FFileHelper::LoadFileToArray(Bundle->Data, *FileName, FILEREAD_Silent) || Bundle->Data.Num() < (int32)sizeof(FHeader))
+    {
+        return nullptr;
+    }
+
+    const FHeader& Header = *(const FHeader*)Bundle->Data.GetData();
+    const uint64 FileSize = Bundle->Data.Num();
+    if (Header.Magic != FileMagic || Header.Version != FileVersion || Header.LuaVersion != LUA_VERSION_NUM
+        || sizeof(FHeader) + (uint64)Header.NumModules * sizeof(FIndexEntry) > FileSize)
+    {
+        UE_LOG(LogTemp, Warning, TEXT("Lua script bundle %s is not compatible with this build"), *FileName);
+        return nullptr;
+    }
+
+    Bundle->Index = (const FIndexEntry*)(Bundle->Data.GetData() + sizeof(FHeader));
+    Bundle->NumModules = Header.NumModules;
+    for (int32 EntryIndex = 0; EntryIndex < Bundle->NumModules; ++EntryIndex)
+    {
+        const FIndexEntry& Entry = Bundle->Index[EntryIndex];
+        const bool bInBounds = (uint64)Entry.NameOffset + Entry.NameLength <= FileSize && Entry.BlobOffset + Entry.BlobSize <= FileSize;
+        //Find relies on the order, so a bundle that is not sorted is as broken as a truncated one
+        if (!bInBounds || (EntryIndex > 0 && Bundle->GetName(Bundle->Index[EntryIndex - 1]).Compare(Bundle->GetName(Entry)) >= 0))
+        {
+            UE_LOG(LogTemp, Warning, TEXT("Lua script bundle %s is corrupt"), *FileName);
+            return nullptr;
+        }
+    }
+    return Bundle;
+}
+
+TConstArrayView<uint8> FLuaScriptBundle::Find(FUtf8StringView PackageName) const
+{
+    int32 Low = 0;
+    int32 High = NumModules;
+    while (Low < High)
+    {
+        const int32 Middle = Low + (High - Low) / 2;
+        const int32 Order = GetName(Index[Middle]).Compare(PackageName);
+        if (Order == 0)
+        {
+            return TConstArrayView<uint8>(Data.GetData() + Index[Middle].BlobOffset, (int32)Index[Middle].BlobSize);
+        }
+        if (Order < 0)
+        {
+            Low = Middle + 1;
+        }
+        else
+        {
+            High = Middle;
+        }
+    }
+    return TConstArrayView<uint8>();
+}
+
+#if WITH_EDITOR
+static int WriteBundleBytecode(lua_State* L, const void* p, size_t sz, void* ud)
+{
+    ((TArray<uint8>*)ud)->Append((const uint8*)p, (int32)sz);
+    return 0;
+}
+
+bool FLuaScriptBundle::Build(const FString& FileName, bool bStripDebugInfo)
+{
+    struct FModule
+    {
+        FTCHARToUTF8 Name;
+        TArray<uint8> Bytecode;
+
+        explicit FModule(const FString& InName) : Name(*InName) {}
+        FUtf8StringView GetName() const { return FUtf8StringView((const UTF8CHAR*)Name.Get(), Name.Length()); }
+    };
+    TArray<TUniquePtr<FModule>> Modules;
+
+    lua_State* L = luaL_newstate();
+    bool bSuccess = true;
+
+    TArray<FString> RootPaths;
+    FPackageName::QueryRootContentPaths(RootPaths);
+    for (const FString& RootPath : RootPaths)
+    {
+        const FString Directory = FPaths::ConvertRelativePathToFull(FPackageName::LongPackageNameToFilename(RootPath)) / TEXT("");
+        TArray<FString> Files;
+        IFileManager::Get().FindFilesRecursive(Files, *Directory, TEXT("*.lua"), true, false);
+        for (const FString& File : Files)
+        {
+            FString RelativePath = File;
+            FPaths::MakePathRelativeTo(RelativePath, *Directory);
+            const FString PackageName = RootPath / FPaths::GetBaseFilename(RelativePath, false);
+
+            FString Source;
+            if (!FFileHelper::LoadFileToString(Source, *File))
+            {
+                UE_LOG(LogTemp, Error, TEXT("Lua script bundle: can not read %s"), *File);
+                bSuccess = false;
+                continue;
+            }
+            FTCHARToUTF8 Utf8Source(*Source);
+            FTCHARToUTF8 ChunkName(*PackageName);
+            if (luaL_loadbufferx(L, Utf8Source.Get(), Utf8Source.Length(), ChunkName.Get(), "t") != LUA_OK)
+            {
+                UE_LOG(LogTemp, Error, TEXT("Lua script bundle: %s"), UTF8_TO_TCHAR(lua_tostring(L, -1)));
+                lua_pop(L, 1);
+                bSuccess = false;
+                continue;
+            }
+            TUniquePtr<FModule>& Module = Modules.Add_GetRef(MakeUnique<FModule>(PackageName));
+            lua_dump(L, WriteBundleBytecode, &Module->Bytecode, bStripDebugInfo ? 1 : 0);
+            lua_pop(L, 1);
+        }
+    }
+    lua_close(L);
+
+    if (!bSuccess)
+    {
+        return false;
+    }
+
+    Modules.Sort([](const TUniquePtr<FModule>& A, const TUniquePtr<FModule>& B) { return A->GetName().Compare(B->GetName()) < 0; });
+    for (int32 ModuleIndex = 1; ModuleIndex < Modules.Num(); ++ModuleIndex)
+    {
+        if (Modules[ModuleIndex - 1]->GetName().Compare(Modules[ModuleIndex]->GetName()) == 0)
+        {
+            UE_LOG(LogTemp, Error, TEXT("Lua script bundle: module %s exists twice"), UTF8_TO_TCHAR(Modules[ModuleIndex]->Name.Get()));
+            return false;
+        }
+    }
+
+    TArray<uint8> File;
+    const FHeader Header{ FileMagic, FileVersion, LUA_VERSION_NUM, (uint32)Modules.Num() };
+    File.Append((const uint8*)&Header, sizeof(Header));
+    const int32 IndexStart = File.Num();
+    File.AddZeroed(Modules.Num() * sizeof(FIndexEntry));
+
+    for (int32 ModuleIndex = 0; ModuleIndex < Modules.Num(); ++ModuleIndex)
+    {
+        FIndexEntry& Entry = ((FIndexEntry*)(File.GetData() + IndexStart))[ModuleIndex];
+        Entry.NameOffset = File.Num();
+        Entry.NameLength = Modules[ModuleIndex]->Name.Length();
+        File.Append((const uint8*)Modules[ModuleIndex]->Name.Get(), Modules[ModuleIndex]->Name.Length());
+    }
+    for (int32 ModuleIndex = 0; ModuleIndex < Modules.Num(); ++ModuleIndex)
+    {
+        File.AddZeroed(Align(File.Num(), BlobAlignment) - File.Num());
+        FIndexEntry& Entry = ((FIndexEntry*)(File.GetData() + IndexStart))[ModuleIndex];
+        Entry.BlobOffset = File.Num();
+        Entry.BlobSize = Modules[ModuleIndex]->Bytecode.Num();
+        File.Append(Modules[ModuleIndex]->Bytecode);
+    }
+
+    if (!FFileHelper::SaveArrayToFile(File, *FileName))
+    {
+        UE_LOG(LogTemp, Error, TEXT("Lua script bundle: can not write %s"), *FileName);
+        return false;
+    }
+    UE_LOG(LogTemp, Display, TEXT("Lua script bundle: %d modules, %d bytes written to %s"), Modules.Num(), File.Num(), *FileName);
+    return true;
+}
+#endif
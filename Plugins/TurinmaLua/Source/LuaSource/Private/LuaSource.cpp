@@ -1,10 +1,27 @@
 // Copyright Epic Games, Inc. All Rights Reserved.
 
 #include "LuaSource.h"
+#include "LuaStatePool.h"
+#include "LuaScriptBundle.h"
+#include "LuaMath.h"
 #include "lua.hpp"
 #include <string>
 #include <thread>
-#include <unordered_map>
+#include "Stats/Stats.h"
+#include "HAL/IConsoleManager.h"
+#include "Async/UniqueLock.h"
+#include "Hash/xxhash.h"
+#include "Misc/Paths.h"
+#include "Misc/FileHelper.h"
+#include "Misc/PackageName.h"
+#include "HAL/FileManager.h"
+#include "Misc/CoreDelegates.h"
+#include "ProfilingDebugging/CsvProfiler.h"
+#include "UObject/EnumProperty.h"
+#if WITH_EDITOR
+#include "DirectoryWatcherModule.h"
+#include "IDirectoryWatcher.h"
+#endif
 
 
 
@@ -14,6 +31,8 @@ EXTERN_C {
 #include "lstate.h"
 #include "ltable.h"
 #include "lstring.h"
+#include "lgc.h"
+#include "lfunc.h"
 }
 
 
@@ -35,488 +54,271 @@ UE_DISABLE_OPTIMIZATION
 
 
 
-static void travelluaobj(global_State* g, GCObject* o, TFunction<void(GCObject*, bool, lua_State*)>& cb, std::unordered_map<GCObject*, bool>& visited, bool strong);
-
-
-
 /*
-** Traverse a table with weak values and link it to proper list. During
-** propagate phase, keep it in 'grayagain' list, to be revisited in the
-** atomic phase. In the atomic phase, if table has any white value,
-** put it in 'weak' list, to be cleared.
+** Heap walker used to find what lua still references.
+** Visited objects are tagged with WALKBIT (the collector itself never uses it) instead of
+** being put in a hash map, and pending objects live in two explicit stacks instead of the
+** C stack. The strong stack is drained before the weak one, so every object is reported
+** exactly once with its final strength. The tags are cleared by a linear pass over the gc
+** lists before returning.
 */
-static void traverseweakvalue(global_State* g, Table* h, TFunction<void(GCObject*, bool, lua_State*)>& cb, std::unordered_map<GCObject*, bool>& visited, bool strong) {
-
+#define WALKBIT TESTBIT
+
+DECLARE_CYCLE_STAT(TEXT("Lua Heap Walk"), STAT_LuaHeapWalk, STATGROUP_TurinmaLua);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Lua Heap Walk Objects"), STAT_LuaHeapWalkObjects, STATGROUP_TurinmaLua);
+DECLARE_MEMORY_STAT(TEXT("Lua Heap Walk Stack Peak"), STAT_LuaHeapWalkStackPeak, STATGROUP_TurinmaLua);
+DECLARE_CYCLE_STAT(TEXT("Lua Collect UE Refs"), STAT_LuaCollectUERefs, STATGROUP_TurinmaLua);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Lua Live UE Data"), STAT_LuaLiveUEData, STATGROUP_TurinmaLua);
+DECLARE_CYCLE_STAT(TEXT("Lua Push UE Data"), STAT_LuaPushUEData, STATGROUP_TurinmaLua);
+DECLARE_DWORD_ACCUMULATOR_STAT(TEXT("Lua UObject Cache Hits (allocations avoided)"), STAT_LuaUObjectCacheHits, STATGROUP_TurinmaLua);
+DECLARE_DWORD_ACCUMULATOR_STAT(TEXT("Lua UObject Cache Misses"), STAT_LuaUObjectCacheMisses, STATGROUP_TurinmaLua);
+DECLARE_CYCLE_STAT(TEXT("Lua Destroy UE Data"), STAT_LuaDestroyUEData, STATGROUP_TurinmaLua);
+DECLARE_CYCLE_STAT(TEXT("Lua Call UFunction"), STAT_LuaCallUFunction, STATGROUP_TurinmaLua);
+DECLARE_DWORD_ACCUMULATOR_STAT(TEXT("Lua Lock Contended"), STAT_LuaLockContended, STATGROUP_TurinmaLua);
+DECLARE_DWORD_ACCUMULATOR_STAT(TEXT("Lua Struct Inline"), STAT_LuaStructInline, STATGROUP_TurinmaLua);
+DECLARE_DWORD_ACCUMULATOR_STAT(TEXT("Lua Struct Spilled"), STAT_LuaStructSpilled, STATGROUP_TurinmaLua);
+DECLARE_MEMORY_STAT(TEXT("Lua Struct Slab Memory"), STAT_LuaStructSlabMemory, STATGROUP_TurinmaLua);
+DECLARE_CYCLE_STAT(TEXT("Lua GC Step"), STAT_LuaGCStep, STATGROUP_TurinmaLua);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Lua GC Steps"), STAT_LuaGCSteps, STATGROUP_TurinmaLua);
+DECLARE_DWORD_ACCUMULATOR_STAT(TEXT("Lua GC Pressure Releases"), STAT_LuaGCPressure, STATGROUP_TurinmaLua);
+DECLARE_MEMORY_STAT(TEXT("Lua Heap Size"), STAT_LuaHeapSize, STATGROUP_TurinmaLua);
+DECLARE_DWORD_ACCUMULATOR_STAT(TEXT("Lua Memory Limit Hits"), STAT_LuaMemoryLimitHits, STATGROUP_TurinmaLua);
+CSV_DEFINE_CATEGORY(TurinmaLua, true);
+DECLARE_CYCLE_STAT(TEXT("Lua Load Chunk"), STAT_LuaLoadChunk, STATGROUP_TurinmaLua);
+DECLARE_DWORD_ACCUMULATOR_STAT(TEXT("Lua Bytecode Cache Hits"), STAT_LuaBytecodeCacheHits, STATGROUP_TurinmaLua);
+DECLARE_DWORD_ACCUMULATOR_STAT(TEXT("Lua Bytecode Cache Misses"), STAT_LuaBytecodeCacheMisses, STATGROUP_TurinmaLua);
+DECLARE_DWORD_ACCUMULATOR_STAT(TEXT("Lua Module Resolve Hits"), STAT_LuaModuleResolveHits, STATGROUP_TurinmaLua);
+DECLARE_DWORD_ACCUMULATOR_STAT(TEXT("Lua Module Resolve Negative Hits"), STAT_LuaModuleResolveNegativeHits, STATGROUP_TurinmaLua);
+DECLARE_DWORD_ACCUMULATOR_STAT(TEXT("Lua Module Resolve Misses"), STAT_LuaModuleResolveMisses, STATGROUP_TurinmaLua);
+DECLARE_DWORD_ACCUMULATOR_STAT(TEXT("Lua Bundle Loads"), STAT_LuaBundleLoads, STATGROUP_TurinmaLua);
+
+static TAutoConsoleVariable<bool> CVarLuaUseUEDataRegistry(
+    TEXT("TurinmaLua.UseUEDataRegistry"),
+    true,
+    TEXT("Collect UE references held by lua from the live userdata registry instead of walking the whole lua heap."));
+
+static TAutoConsoleVariable<bool> CVarLuaTrackStructSpills(
+    TEXT("TurinmaLua.TrackStructSpills"),
+    false,
+    TEXT("Count which structs pushed to lua do not fit in FLuaUStructData's inline storage, see TurinmaLua.DumpStructSpills."));
+
+static TAutoConsoleVariable<int32> CVarLuaBytecodeCache(
+    TEXT("TurinmaLua.BytecodeCache"),
+    UE_BUILD_SHIPPING ? 1 : 2,
+    TEXT("0: always compile required sources, 1: reuse bytecode compiled by any lua state of this process, 2: also keep it on disk under Saved/LuaBytecode. Shipping builds default to 1."));
+
+struct FLuaHeapWalker
+{
+    global_State* g;
+    LuaCPPAPI::FLuaHeapWalkContext& Context;
+    TFunctionRef<void(GCObject*, bool, lua_State*)> Callback;
+    bool bUserdataOnly;
+    uint32 VisitedNum = 0;
 
-    unsigned int asize = luaH_realasize(h);
-    
-    /* traverse array part */
-    for (unsigned int i = 0; i < asize; i++) {
-        auto arrayEle = &h->array[i];
-        if(iscollectable(arrayEle))
+    void Push(GCObject* o, bool strong)
+    {
+        if (!o || testbit(o->marked, WALKBIT))
         {
-            travelluaobj(g, gcvalue(arrayEle), cb, visited, false);
+            return;
         }
-    }
-
-    Node* n, * limit = gnodelast(h);
-    for (n = gnode(h, 0); n < limit; n++) {  /* traverse hash part */
-        auto Key = gckeyN(n);
-        auto Value = gval(n);
-        if(Key)
+        if (bUserdataOnly && (o->tt == LUA_VSHRSTR || o->tt == LUA_VLNGSTR))
         {
-            travelluaobj(g, Key, cb, visited, strong);
+            return; /* leaf and never reported */
         }
-        if (iscollectable(Value))
-        {
-            travelluaobj(g,gcvalue(Value), cb, visited, false);
-           
-        }  /* entry is empty? */
+        (strong ? Context.StrongStack : Context.WeakStack).Add(o);
     }
-}
-
-
-static void traverseallweaktable(global_State* g, Table* h, TFunction<void(GCObject*, bool, lua_State*)>& cb, std::unordered_map<GCObject*, bool>& visited, bool strong) {
-
 
-    unsigned int asize = luaH_realasize(h);
-
-    /* traverse array part */
-    for (unsigned int i = 0; i < asize; i++) {
-        auto arrayEle = &h->array[i];
-        if (iscollectable(arrayEle))
+    void PushValue(const TValue* tv, bool strong)
+    {
+        if (iscollectable(tv))
         {
-            travelluaobj(g, gcvalue(arrayEle), cb, visited, false);
+            Push(gcvalue(tv), strong);
         }
     }
 
-    Node* n, * limit = gnodelast(h);
-    for (n = gnode(h, 0); n < limit; n++) {  /* traverse hash part */
-        auto Key = gckeyN(n);
-        auto Value = gval(n);
-        if (Key)
+    void TraverseTable(Table* h, bool strong)
+    {
+        bool weakkey = false, weakvalue = false;
+        const TValue* mode = gfasttm(g, h->metatable, TM_MODE);
+        if (mode && ttisstring(mode))
         {
-            travelluaobj(g, Key, cb, visited, false);
+            weakkey = strchr(svalue(mode), 'k') != nullptr;
+            weakvalue = strchr(svalue(mode), 'v') != nullptr;
         }
-        if (iscollectable(Value))
-        {
-            travelluaobj(g, gcvalue(Value), cb, visited, false);
-
-        }  /* entry is empty? */
-    }
-}
+        const bool strongkey = strong && !weakkey;
+        const bool strongvalue = strong && !weakvalue;
 
+        Push(obj2gco(h->metatable), strong);
 
-static void traverseweakkey(global_State* g, Table* h, int inv, TFunction<void(GCObject*, bool, lua_State*)>& cb, std::unordered_map<GCObject*, bool>& visited, bool strong) {
-
-
-    int marked = 0;  /* true if an object is marked in this traversal */
-    unsigned int i;
-    unsigned int asize = luaH_realasize(h);
-    unsigned int nsize = sizenode(h);
-    /* traverse array part */
-    for (i = 0; i < asize; i++) {
-        auto arrayEle = &h->array[i];
-        if (iscollectable(arrayEle))
+        unsigned int asize = luaH_realasize(h);
+        for (unsigned int i = 0; i < asize; i++)  /* traverse array part */
         {
-            travelluaobj(g, gcvalue(arrayEle), cb, visited, strong);
+            PushValue(&h->array[i], strongvalue);
         }
-    }
-    /* traverse hash part; if 'inv', traverse descending
-       (see 'convergeephemerons') */
-    for (i = 0; i < nsize; i++) {
-        Node* n = inv ? gnode(h, nsize - 1 - i) : gnode(h, i);
-        auto Key = gckeyN(n);
-        auto Value = gval(n);
-        if (Key)
+
+        Node* n, * limit = gnodelast(h);
+        for (n = gnode(h, 0); n < limit; n++)  /* traverse hash part */
         {
-            travelluaobj(g, Key, cb, visited, false);
+            if (isempty(gval(n)))  /* entry is empty? */
+            {
+                continue;
+            }
+            Push(gckeyN(n), strongkey);
+            PushValue(gval(n), strongvalue);
         }
-        if (iscollectable(Value))
-        {
-            travelluaobj(g, gcvalue(Value), cb, visited, strong);
-
-        }  /* entry is empty? */
     }
-}
-
 
-static void traversestrongtable(global_State* g, Table* h, TFunction<void(GCObject*, bool, lua_State*)>& cb, std::unordered_map<GCObject*, bool>& visited, bool strong) {
-
-    Node* n, * limit = gnodelast(h);
-    unsigned int i;
-    unsigned int asize = luaH_realasize(h);
-    for (i = 0; i < asize; i++)  /* traverse array part */
+    void TraverseUdata(Udata* u, bool strong)
     {
-        auto arrayEle = &h->array[i];
-        if (iscollectable(arrayEle))
-        {
-            travelluaobj(g, gcvalue(arrayEle), cb, visited, strong);
-        }
-    }
-    for (n = gnode(h, 0); n < limit; n++) {  /* traverse hash part */
-        auto Key = gckeyN(n);
-        auto Value = gval(n);
-        if (Key)
+        Push(obj2gco(u->metatable), strong);
+        for (int i = 0; i < u->nuvalue; i++)
         {
-            travelluaobj(g, Key, cb, visited, strong);
+            PushValue(&u->uv[i].uv, strong);
         }
-        if (iscollectable(Value))
-        {
-            travelluaobj(g, gcvalue(Value), cb, visited, strong);
-
-        }  /* entry is empty? */
     }
-}
-
-
-static void traversetable(global_State* g, Table* h, TFunction<void(GCObject*, bool, lua_State*)>& cb, std::unordered_map<GCObject*, bool>& visited, bool strong) {
-
 
-    auto&& res = visited.emplace(obj2gco(h), strong);
-
-    if (!strong)
+    void TraverseProto(Proto* f, bool strong)
     {
-        if (!res.second)
+        int i;
+        Push(obj2gco(f->source), strong);
+        for (i = 0; i < f->sizek; i++)  /* mark literals */
         {
-            return;
+            PushValue(&f->k[i], strong);
         }
-    }
-    else
-    {
-        if (!res.second && res.first->second)
+        for (i = 0; i < f->sizeupvalues; i++)  /* mark upvalue names */
         {
-            return;
+            Push(obj2gco(f->upvalues[i].name), strong);
         }
-    }
-
-    if (cb)
-    {
-        cb(obj2gco(h), strong, g->mainthread);
-    }
-
-
-    const char* weakkey, * weakvalue;
-    const TValue* mode = gfasttm(g, h->metatable, TM_MODE);
-    travelluaobj(g, obj2gco(h->metatable), cb, visited, strong);
-    if (mode && ttisstring(mode) &&  /* is there a weak mode? */
-        (cast_void(weakkey = strchr(svalue(mode), 'k')),
-            cast_void(weakvalue = strchr(svalue(mode), 'v')),
-            (weakkey || weakvalue))) {  /* is really weak? */
-        if (!weakkey)  /* strong keys? */
-            traverseweakvalue(g, h, cb, visited, strong);
-        else if (!weakvalue)  /* strong values? */
-            traverseweakkey(g, h, 0, cb, visited, strong);
-        else  /* all weak */
-            traverseallweaktable(g, h, cb, visited, strong);  /* nothing to traverse now */
-    }
-    else  /* not weak */
-        traversestrongtable(g, h, cb, visited, strong);
-}
-
-
-static void traverseudata(global_State* g, Udata* u, TFunction<void(GCObject*, bool, lua_State*)>& cb, std::unordered_map<GCObject*, bool>& visited, bool strong) {
-
-    auto&& res = visited.emplace(obj2gco(u), strong);
-
-    if (!strong)
-    {
-        if (!res.second)
+        for (i = 0; i < f->sizep; i++)  /* mark nested protos */
         {
-            return;
+            Push(obj2gco(f->p[i]), strong);
         }
-    }
-    else
-    {
-        if (!res.second && res.first->second)
+        for (i = 0; i < f->sizelocvars; i++)  /* mark local-variable names */
         {
-            return;
+            Push(obj2gco(f->locvars[i].varname), strong);
         }
     }
 
-    if (cb)
-    {
-        cb(obj2gco(u), strong, g->mainthread);
-    }
-
-
-	int i;
-    travelluaobj(g, obj2gco(u->metatable), cb, visited, strong);
-    for (i = 0; i < u->nuvalue; i++)
+    void TraverseThread(lua_State* th, bool strong)
     {
-        auto tv = &u->uv[i].uv;
-        if(iscollectable(tv))
+        StkId o = th->stack.p;
+        if (o == NULL)
         {
-            travelluaobj(g, gcvalue(tv), cb, visited, strong);
+            return;  /* stack not completely built yet */
         }
-    }
-}
-
-
-/*
-** Traverse a prototype. (While a prototype is being build, its
-** arrays can be larger than needed; the extra slots are filled with
-** NULL, so the use of 'markobjectN')
-*/
-static void traverseproto(global_State* g, Proto* f, TFunction<void(GCObject*, bool, lua_State*)>& cb, std::unordered_map<GCObject*, bool>& visited, bool strong) {
-
-
-    auto&& res = visited.emplace(obj2gco(f), strong);
-
-    if (!strong)
-    {
-        if (!res.second)
+        for (; o < th->top.p; o++)  /* mark live elements in the stack */
         {
-            return;
+            PushValue(s2v(o), strong);
         }
-    }
-    else
-    {
-        if (!res.second && res.first->second)
+        for (UpVal* uv = th->openupval; uv != NULL; uv = uv->u.open.next)
         {
-            return;
+            Push(obj2gco(uv), strong);  /* open upvalues cannot be collected */
         }
     }
 
-    if (cb)
+    void Visit(GCObject* o, bool strong)
     {
-        cb(obj2gco(f), strong, g->mainthread);
-    }
+        l_setbit(o->marked, WALKBIT);
+        ++VisitedNum;
 
-
-    int i;
-    travelluaobj(g, obj2gco(f->source), cb, visited, strong);
-    for (i = 0; i < f->sizek; i++)  /* mark literals */
-    {
-        auto tv = &f->k[i];
-        if (iscollectable(tv))
+        if (!bUserdataOnly || o->tt == LUA_VUSERDATA)
         {
-            travelluaobj(g, gcvalue(tv), cb, visited, strong);
+            Callback(o, strong, g->mainthread);
         }
-    }
-
-    for (i = 0; i < f->sizeupvalues; i++)  /* mark upvalue names */
-    {
-        //markobjectN(g, f->upvalues[i].name);
-        travelluaobj(g, obj2gco(f->upvalues[i].name), cb, visited, strong);
-    }
-        
-    for (i = 0; i < f->sizep; i++)  /* mark nested protos */
-    {
-        //markobjectN(g, f->p[i]);
-        travelluaobj(g, obj2gco(f->p[i]), cb, visited, strong);
-    }
-        
-    for (i = 0; i < f->sizelocvars; i++)  /* mark local-variable names */
-    {
-        //markobjectN(g, f->locvars[i].varname);
-        travelluaobj(g, obj2gco(f->locvars[i].varname), cb, visited, strong);
-    }
-
-}
-
-
-static void traverseCclosure(global_State* g, CClosure* cl, TFunction<void(GCObject*, bool, lua_State*)>& cb, std::unordered_map<GCObject*, bool>& visited, bool strong) {
-
-    auto&& res = visited.emplace(obj2gco(cl), strong);
 
-    if (!strong)
-    {
-        if (!res.second)
+        switch (o->tt) {
+        case LUA_VTABLE: TraverseTable(gco2t(o), strong); break;
+        case LUA_VUSERDATA: TraverseUdata(gco2u(o), strong); break;
+        case LUA_VLCL:
         {
-            return;
+            LClosure* cl = gco2lcl(o);
+            Push(obj2gco(cl->p), strong);
+            for (int i = 0; i < cl->nupvalues; i++)  /* visit its upvalues */
+            {
+                Push(obj2gco(cl->upvals[i]), strong);
+            }
+            break;
         }
-    }
-    else
-    {
-        if (!res.second && res.first->second)
+        case LUA_VCCL:
         {
-            return;
+            CClosure* cl = gco2ccl(o);
+            for (int i = 0; i < cl->nupvalues; i++)  /* mark its upvalues */
+            {
+                PushValue(&cl->upvalue[i], strong);
+            }
+            break;
         }
-    }
-
-    if (cb)
-    {
-        cb(obj2gco(cl), strong, g->mainthread);
-    }
-
-	int i;
-    for (i = 0; i < cl->nupvalues; i++)  /* mark its upvalues */
-    {
-        //markvalue(g, &cl->upvalue[i]);
-        auto tv = &cl->upvalue[i];
-        if (iscollectable(tv))
-        {
-            travelluaobj(g, gcvalue(tv), cb, visited, strong);
+        case LUA_VUPVAL: PushValue(gco2upv(o)->v.p, strong); break;
+        case LUA_VPROTO: TraverseProto(gco2p(o), strong); break;
+        case LUA_VTHREAD: TraverseThread(gco2th(o), strong); break;
+        default: break;  /* strings have no children */
         }
     }
-}
-
-/*
-** Traverse a Lua closure, marking its prototype and its upvalues.
-** (Both can be NULL while closure is being created.)
-*/
-static void traverseLclosure(global_State* g, LClosure* cl, TFunction<void(GCObject*, bool, lua_State*)>& cb, std::unordered_map<GCObject*, bool>& visited, bool strong) {
 
-    auto&& res = visited.emplace(obj2gco(cl), strong);
-
-    if (!strong)
-    {
-        if (!res.second)
-        {
-            return;
-        }
-    }
-    else
+    void Drain(TArray<GCObject*>& Stack, bool strong)
     {
-        if (!res.second && res.first->second)
+        while (Stack.Num() > 0)
         {
-            return;
+            Context.PeakStackNum = FMath::Max(Context.PeakStackNum, Context.StrongStack.Num() + Context.WeakStack.Num());
+            GCObject* o = Stack.Pop(EAllowShrinking::No);
+            if (!testbit(o->marked, WALKBIT))
+            {
+                Visit(o, strong);
+            }
         }
     }
+};
 
-    if (cb)
+static void clearwalkmarks(GCObject* o)
+{
+    for (; o != NULL; o = o->next)
     {
-        cb(obj2gco(cl), strong, g->mainthread);
-    }
-
-
-	int i;
-    travelluaobj(g, obj2gco(cl->p), cb, visited, strong);
-    for (i = 0; i < cl->nupvalues; i++) {  /* visit its upvalues */
-        UpVal* uv = cl->upvals[i];
-        travelluaobj(g, obj2gco(uv), cb, visited, strong);
+        resetbit(o->marked, WALKBIT);
     }
 }
 
+void LuaCPPAPI::luaC_foreachgcobj(lua_State* L, FLuaHeapWalkContext& Context, TFunctionRef<void(GCObject*, bool, lua_State*)> cb, bool bUserdataOnly)
+{
+    SCOPE_CYCLE_COUNTER(STAT_LuaHeapWalk);
 
-/*
-** Traverse a thread, marking the elements in the stack up to its top
-** and cleaning the rest of the stack in the final traversal. That
-** ensures that the entire stack have valid (non-dead) objects.
-** Threads have no barriers. In gen. mode, old threads must be visited
-** at every cycle, because they might point to young objects.  In inc.
-** mode, the thread can still be modified before the end of the cycle,
-** and therefore it must be visited again in the atomic phase. To ensure
-** these visits, threads must return to a gray list if they are not new
-** (which can only happen in generational mode) or if the traverse is in
-** the propagate phase (which can only happen in incremental mode).
-*/
-static void traversethread(global_State* g, lua_State* th, TFunction<void(GCObject*, bool, lua_State*)>& cb, std::unordered_map<GCObject*, bool>& visited, bool strong) {
-
-
-    auto&& res = visited.emplace(obj2gco(th), strong);
-
-    if (!strong)
-    {
-        if (!res.second)
-        {
-            return;
-        }
-    }
-    else
-    {
-        if (!res.second && res.first->second)
-        {
-            return;
-        }
-    }
-
-    if (cb)
-    {
-        cb(obj2gco(th), strong, g->mainthread);
-    }
+    lua_lock(L);
+    global_State* g = L->l_G;
+    FLuaHeapWalker Walker{ g, Context, cb, bUserdataOnly };
+    Context.StrongStack.Reset();
+    Context.WeakStack.Reset();
 
-    UpVal* uv;
-    StkId o = th->stack.p;
-    
-    if (o == NULL)
-        return;  /* stack not completely built yet */
-    
-    for (; o < th->top.p; o++)  /* mark live elements in the stack */
-    {
-        //markvalue(g, s2v(o));
-        auto tv = s2v(o);
-        if (iscollectable(tv))
-        {
-            travelluaobj(g, gcvalue(tv), cb, visited, strong);
-        }
-    }
-        
-    for (uv = th->openupval; uv != NULL; uv = uv->u.open.next)
+    Walker.Push(obj2gco(g->mainthread), true);
+    Walker.Push(gcvalue(&g->l_registry), true);
+    for (int i = 0; i < LUA_NUMTAGS; i++)
     {
-        //markobject(g, uv);  /* open upvalues cannot be collected */
-        travelluaobj(g, obj2gco(uv), cb, visited, strong);
+        Walker.Push(obj2gco(g->mt[i]), true);
     }
-}
-
-
-/*
-** traverse one gray object, turning it to black.
-*/
-static void travelluaobj(global_State* g, GCObject* o, TFunction<void(GCObject*, bool, lua_State*)>& cb, std::unordered_map<GCObject*, bool>& visited, bool strong) {
-    if(!o)
+    for (auto o = g->tobefnz; o != NULL; o = o->next)
     {
-        return;
+        Walker.Push(o, true);
     }
 
-    switch (o->tt) {
-    case LUA_VTABLE: return traversetable(g, gco2t(o), cb, visited, strong);
-    case LUA_VUSERDATA: return traverseudata(g, gco2u(o), cb, visited, strong);
-    case LUA_VLCL: return traverseLclosure(g, gco2lcl(o), cb, visited, strong);
-    case LUA_VCCL: return traverseCclosure(g, gco2ccl(o), cb, visited, strong);
-    case LUA_VPROTO: return traverseproto(g, gco2p(o), cb, visited, strong);
-    case LUA_VTHREAD: return traversethread(g, gco2th(o), cb, visited, strong);
-    default:
-	    {
-        auto&& res = visited.emplace(o, strong);
+    /* strong edges first, everything left over is only weakly reachable */
+    Walker.Drain(Context.StrongStack, true);
+    Walker.Drain(Context.WeakStack, false);
 
-        if (!strong)
-        {
-            if (!res.second)
-            {
-                return;
-            }
-        }
-        else
-        {
-            if (!res.second && res.first->second)
-            {
-                return;
-            }
-        }
+    resetbit(g->mainthread->marked, WALKBIT);
+    clearwalkmarks(g->allgc);
+    clearwalkmarks(g->finobj);
+    clearwalkmarks(g->tobefnz);
+    clearwalkmarks(g->fixedgc);
+    lua_unlock(L);
 
-        if (cb)
-        {
-            cb(o, strong, g->mainthread);
-        }
-	    }
-    }
+    SET_DWORD_STAT(STAT_LuaHeapWalkObjects, Walker.VisitedNum);
+    SET_MEMORY_STAT(STAT_LuaHeapWalkStackPeak, Context.PeakStackNum * sizeof(GCObject*));
 }
 
-
 void LuaCPPAPI::luaC_foreachgcobj(lua_State* L, TFunction<void(GCObject*, bool, lua_State*)> cb)
 {
     if(cb)
     {
-        lua_lock(L);
-        global_State* g = L->l_G;
-        std::unordered_map<GCObject*, bool> ObjectHasVisit;
-
-        travelluaobj(g, obj2gco(g->mainthread), cb, ObjectHasVisit, true);
-        travelluaobj(g, gcvalue(&g->l_registry), cb, ObjectHasVisit, true);
-        for (int i = 0; i < LUA_NUMTAGS; i++)
-        {
-            if (g->mt[i])
-            {
-                travelluaobj(g, obj2gco(g->mt[i]), cb, ObjectHasVisit, true);
-            }
-        }
-        for (auto o = g->tobefnz; o != NULL; o = o->next) {
-            
-            travelluaobj(g, o, cb, ObjectHasVisit, true);
-        }
-        lua_unlock(L);
+        FLuaHeapWalkContext Context;
+        luaC_foreachgcobj(L, Context, cb, false);
     }
 }
 
@@ -571,85 +373,370 @@ void AddUsefulLuaTableWithMetatableToTable(lua_State* L, const char* tableId, in
     //lua_pop(L, 1);
 }
 FOnLuaLoadFile FLuaSourceModule::OnLuaLoadFile;
+FOnLuaLoadFileBytes FLuaSourceModule::OnLuaLoadFileBytes;
 
-static int CustomLoaderInternal(lua_State* L, bool bForceDefaultLoader)
+/*
+** Bytecode of required modules keyed by module name and the hash of the source it was compiled
+** from. It is shared by every state of the process and written under Saved/ so the next run skips
+** the parser as well. A stale, foreign or corrupt entry only costs compiling the source again.
+*/
+struct FLuaBytecodeCache
 {
-    const char* ModuleName = luaL_checkstring(L, 1);
-    FString ModuleNameStr = UTF8_TO_TCHAR(ModuleName);
-    if (ModuleNameStr.IsEmpty())
+    struct FEntry
     {
-        lua_pushstring(L, "module name is empty");
-        return 1; // File not found
+        uint64 SourceHash = 0;
+        TArray<uint8> Bytecode;
+    };
+
+    struct FFileHeader
+    {
+        uint32 Magic;
+        uint32 LuaVersion;
+        uint64 SourceHash;
+        //lundump does not survive malformed input, so a torn or edited file must never reach it
+        uint64 BytecodeHash;
+    };
+
+    static constexpr uint32 FileMagic = 0x43424C54; //TLBC
+
+    UE::FMutex Mutex;
+    TMap<FString, TSharedPtr<const FEntry, ESPMode::ThreadSafe>> Entries;
+
+    static FLuaBytecodeCache& Get()
+    {
+        static FLuaBytecodeCache* Instance = new FLuaBytecodeCache();
+        return *Instance;
     }
 
-    FString Result;
-    bool bLoadSuc = false;
-    if (!bForceDefaultLoader && FLuaSourceModule::OnLuaLoadFile.IsBound())
+    //module names come from scripts, so they are hashed rather than trusted as a path below the cache directory
+    static FString GetFilePath(const FString& ModuleName)
     {
-        bLoadSuc = FLuaSourceModule::OnLuaLoadFile.Execute(ModuleNameStr, Result);
-        if (!bLoadSuc)
-        {
-            lua_pushstring(L, "module load failed");
-            return 1; // File not found
-        }
+        const uint64 NameHash = FXxHash64::HashBuffer(*ModuleName, ModuleName.Len() * sizeof(TCHAR)).Hash;
+        return FPaths::ProjectSavedDir() / TEXT("LuaBytecode") / FString::Printf(TEXT("%016llx.luac"), NameHash);
     }
-    else
+
+    TSharedPtr<const FEntry, ESPMode::ThreadSafe> Find(const FString& ModuleName, uint64 SourceHash, bool bUseDisk)
     {
-        ModuleNameStr.ReplaceCharInline(TEXT('.'), TEXT('/'));
-        if (!ModuleNameStr.StartsWith(TEXT("/")))
         {
-            ModuleNameStr.InsertAt(0, TEXT('/'));
-        }
-        FString FileName;
-        if (!FPackageName::TryConvertLongPackageNameToFilename(ModuleNameStr, FileName, TEXT(".lua")))
-        {
-            ModuleNameStr.InsertAt(0, TEXT("/Game"));
-            if (!FPackageName::TryConvertLongPackageNameToFilename(ModuleNameStr, FileName, TEXT(".lua")))
+            UE::TUniqueLock Lock(Mutex);
+            if (const TSharedPtr<const FEntry, ESPMode::ThreadSafe>* Found = Entries.Find(ModuleName))
             {
-                lua_pushstring(L, "module name is invalid");
-                return 1; // File not found
+                if ((*Found)->SourceHash == SourceHash)
+                {
+                    return *Found;
+                }
             }
         }
 
-        if (!FFileHelper::LoadFileToString(Result, *FileName))
+        TArray<uint8> File;
+        if (!bUseDisk || !FFileHelper::LoadFileToArray(File, *GetFilePath(ModuleName), FILEREAD_Silent) || File.Num() <= sizeof(FFileHeader))
         {
-            lua_pushstring(L, "module load failed");
-            return 1; // File not found
+            return nullptr;
+        }
+        FFileHeader Header;
+        FMemory::Memcpy(&Header, File.GetData(), sizeof(Header));
+        if (Header.Magic != FileMagic || Header.LuaVersion != LUA_VERSION_NUM || Header.SourceHash != SourceHash
+            || Header.BytecodeHash != FXxHash64::HashBuffer(File.GetData() + sizeof(Header), File.Num() - sizeof(Header)).Hash)
+        {
+            return nullptr;
         }
-    }
 
-    std::string utf8Res = TCHAR_TO_UTF8(*Result);
+        TSharedPtr<FEntry, ESPMode::ThreadSafe> Entry = MakeShared<FEntry, ESPMode::ThreadSafe>();
+        Entry->SourceHash = SourceHash;
+        Entry->Bytecode.Append(File.GetData() + sizeof(Header), File.Num() - sizeof(Header));
 
-    int status = luaL_loadbuffer(L, utf8Res.c_str(), utf8Res.size(), ModuleName);
-    if (status != LUA_OK)
-    {
-        lua_error(L);
-        lua_pushstring(L, "module load failed");
-        return 1; // File not found
+        UE::TUniqueLock Lock(Mutex);
+        Entries.Add(ModuleName, Entry);
+        return Entry;
     }
 
-    lua_pushstring(L, ModuleName); // Push the file path onto the stack
-    return 2;
-}
+    void Add(const FString& ModuleName, uint64 SourceHash, TArray<uint8>&& Bytecode, bool bWriteDisk)
+    {
+        TSharedPtr<FEntry, ESPMode::ThreadSafe> Entry = MakeShared<FEntry, ESPMode::ThreadSafe>();
+        Entry->SourceHash = SourceHash;
+        Entry->Bytecode = MoveTemp(Bytecode);
 
-static int CustomLoader(lua_State* L)
-{
-    return CustomLoaderInternal(L, false);
-}
+        if (bWriteDisk)
+        {
+            const FFileHeader Header{ FileMagic, LUA_VERSION_NUM, SourceHash, FXxHash64::HashBuffer(Entry->Bytecode.GetData(), Entry->Bytecode.Num()).Hash };
+            TArray<uint8> File;
+            File.Reserve(sizeof(Header) + Entry->Bytecode.Num());
+            File.Append((const uint8*)&Header, sizeof(Header));
+            File.Append(Entry->Bytecode);
+            FFileHelper::SaveArrayToFile(File, *GetFilePath(ModuleName));
+        }
 
-static int CustomDefaultLoader(lua_State* L)
+        UE::TUniqueLock Lock(Mutex);
+        Entries.Add(ModuleName, MoveTemp(Entry));
+    }
+};
+
+static int WriteBytecode(lua_State* L, const void* p, size_t sz, void* ud)
 {
-    return CustomLoaderInternal(L, true);
+    ((TArray<uint8>*)ud)->Append((const uint8*)p, (int32)sz);
+    return 0;
 }
 
-void RegisterCustomLoader(lua_State* L, bool bDefualt)
+//compiles the module source unless the bytecode cache already has it, leaves the chunk or the error on the stack
+static int LoadModuleChunk(lua_State* L, const char* ModuleName, const char* Source, size_t SourceSize)
 {
-    lua_getglobal(L, "package");
-    lua_getfield(L, -1, "searchers");
-
-    lua_pushinteger(L, 2);
-    lua_pushcfunction(L, bDefualt ? CustomDefaultLoader : CustomLoader);
-    lua_settable(L, -3);
+    SCOPE_CYCLE_COUNTER(STAT_LuaLoadChunk);
+    const int32 CacheMode = CVarLuaBytecodeCache.GetValueOnAnyThread();
+    if (CacheMode <= 0)
+    {
+        return luaL_loadbuffer(L, Source, SourceSize, ModuleName);
+    }
+
+    const bool bUseDisk = CacheMode > 1;
+    const FString Key = UTF8_TO_TCHAR(ModuleName);
+    const uint64 SourceHash = FXxHash64::HashBuffer(Source, SourceSize).Hash;
+    FLuaBytecodeCache& Cache = FLuaBytecodeCache::Get();
+    if (TSharedPtr<const FLuaBytecodeCache::FEntry, ESPMode::ThreadSafe> Entry = Cache.Find(Key, SourceHash, bUseDisk))
+    {
+        if (luaL_loadbufferx(L, (const char*)Entry->Bytecode.GetData(), Entry->Bytecode.Num(), ModuleName, "b") == LUA_OK)
+        {
+            INC_DWORD_STAT(STAT_LuaBytecodeCacheHits);
+            return LUA_OK;
+        }
+        lua_pop(L, 1); //bytecode from another build of lua, compile it again
+    }
+
+    INC_DWORD_STAT(STAT_LuaBytecodeCacheMisses);
+    const int Status = luaL_loadbuffer(L, Source, SourceSize, ModuleName);
+    if (Status == LUA_OK)
+    {
+        TArray<uint8> Bytecode;
+        lua_dump(L, WriteBytecode, &Bytecode, 0);
+        //pool workers compile the same modules at the same time, only states with an owning ULuaState write the files
+        void* UD = nullptr;
+        lua_getallocf(L, &UD);
+        Cache.Add(Key, SourceHash, MoveTemp(Bytecode), bUseDisk && UD != nullptr);
+    }
+    return Status;
+}
+
+/*
+** Where the default loader finds each module name, including names that resolve to nothing, since
+** optional modules are probed on every require. Editor builds drop it whenever a .lua file appears
+** or disappears under a watched content path, or a content path is mounted or dismounted.
+*/
+struct FLuaModuleResolveCache
+{
+    struct FEntry
+    {
+        FString FileName;
+        bool bValidName = false;
+        bool bExists = false;
+    };
+
+    UE::FMutex Mutex;
+    TMap<FString, FEntry> Entries;
+
+    static FLuaModuleResolveCache& Get()
+    {
+        static FLuaModuleResolveCache* Instance = new FLuaModuleResolveCache();
+        return *Instance;
+    }
+
+    static FEntry Resolve(FString ModuleName)
+    {
+        FEntry Entry;
+        ModuleName.ReplaceCharInline(TEXT('.'), TEXT('/'));
+        if (!ModuleName.StartsWith(TEXT("/")))
+        {
+            ModuleName.InsertAt(0, TEXT('/'));
+        }
+        Entry.bValidName = FPackageName::TryConvertLongPackageNameToFilename(ModuleName, Entry.FileName, TEXT(".lua"));
+        if (!Entry.bValidName)
+        {
+            ModuleName.InsertAt(0, TEXT("/Game"));
+            Entry.bValidName = FPackageName::TryConvertLongPackageNameToFilename(ModuleName, Entry.FileName, TEXT(".lua"));
+        }
+        Entry.bExists = Entry.bValidName && IFileManager::Get().FileExists(*Entry.FileName);
+        return Entry;
+    }
+
+    bool Find(const FString& ModuleName, FEntry& OutEntry)
+    {
+        UE::TUniqueLock Lock(Mutex);
+        if (const FEntry* Found = Entries.Find(ModuleName))
+        {
+            OutEntry = *Found;
+            INC_DWORD_STAT(Found->bExists ? STAT_LuaModuleResolveHits : STAT_LuaModuleResolveNegativeHits);
+            return true;
+        }
+        INC_DWORD_STAT(STAT_LuaModuleResolveMisses);
+        return false;
+    }
+
+    void Add(const FString& ModuleName, const FEntry& Entry)
+    {
+        UE::TUniqueLock Lock(Mutex);
+        Entries.Add(ModuleName, Entry);
+    }
+
+    void Reset()
+    {
+        UE::TUniqueLock Lock(Mutex);
+        Entries.Reset();
+    }
+};
+
+//UTF-8 sources are handed to lua in place, anything else is transcoded like LoadFileToString would
+static int LoadModuleBytes(lua_State* L, const char* ModuleName, const TArray<uint8>& Bytes)
+{
+    const uint8* Data = Bytes.GetData();
+    int32 Size = Bytes.Num();
+    const bool bUTF16 = Size >= 2 && ((Data[0] == 0xFF && Data[1] == 0xFE) || (Data[0] == 0xFE && Data[1] == 0xFF));
+    if (bUTF16)
+    {
+        FString Source;
+        FFileHelper::BufferToString(Source, Data, Size);
+        FTCHARToUTF8 Utf8Source(*Source);
+        return LoadModuleChunk(L, ModuleName, Utf8Source.Get(), Utf8Source.Length());
+    }
+    if (Size >= 3 && Data[0] == 0xEF && Data[1] == 0xBB && Data[2] == 0xBF)
+    {
+        Data += 3;
+        Size -= 3;
+    }
+    return LoadModuleChunk(L, ModuleName, (const char*)Data, Size);
+}
+
+//loaded once at startup by cooked builds and only read afterwards, so every thread may look modules up in it
+static TUniquePtr<FLuaScriptBundle> ScriptBundle;
+
+//resolves the module name the way FLuaModuleResolveCache::Resolve does, but against the bundle index
+static bool LoadBundledModule(lua_State* L, const char* ModuleName)
+{
+    TUtf8StringBuilder<256> PackageName;
+    if (ModuleName[0] != '/')
+    {
+        PackageName.AppendChar(UTF8CHAR('/'));
+    }
+    PackageName.Append((const UTF8CHAR*)ModuleName);
+    for (UTF8CHAR* Char = PackageName.GetData(); *Char; ++Char)
+    {
+        if (*Char == UTF8CHAR('.'))
+        {
+            *Char = UTF8CHAR('/');
+        }
+    }
+
+    TConstArrayView<uint8> Bytecode = ScriptBundle->Find(PackageName.ToView());
+    if (Bytecode.Num() == 0)
+    {
+        PackageName.Prepend(UTF8TEXT("/Game"));
+        Bytecode = ScriptBundle->Find(PackageName.ToView());
+    }
+    if (Bytecode.Num() == 0)
+    {
+        return false;
+    }
+    if (luaL_loadbufferx(L, (const char*)Bytecode.GetData(), Bytecode.Num(), ModuleName, "b") != LUA_OK)
+    {
+        lua_pop(L, 1); //the bundle was cooked for another build of lua, fall back to the loose file
+        return false;
+    }
+    INC_DWORD_STAT(STAT_LuaBundleLoads);
+    return true;
+}
+
+//pushes the loaded chunk and returns LUA_OK, otherwise pushes why and returns LUA_ERRFILE when there is no such module
+static int LoadModule(lua_State* L, const char* ModuleName, bool bForceDefaultLoader)
+{
+    FString ModuleNameStr = UTF8_TO_TCHAR(ModuleName);
+    if (ModuleNameStr.IsEmpty())
+    {
+        lua_pushstring(L, "module name is empty");
+        return LUA_ERRFILE;
+    }
+
+    if (!bForceDefaultLoader && FLuaSourceModule::OnLuaLoadFileBytes.IsBound())
+    {
+        TArray<uint8> Bytes;
+        if (!FLuaSourceModule::OnLuaLoadFileBytes.Execute(ModuleNameStr, Bytes))
+        {
+            lua_pushstring(L, "module load failed");
+            return LUA_ERRFILE;
+        }
+        return LoadModuleBytes(L, ModuleName, Bytes);
+    }
+
+    if (!bForceDefaultLoader && FLuaSourceModule::OnLuaLoadFile.IsBound())
+    {
+        FString Result;
+        if (!FLuaSourceModule::OnLuaLoadFile.Execute(ModuleNameStr, Result))
+        {
+            lua_pushstring(L, "module load failed");
+            return LUA_ERRFILE;
+        }
+        FTCHARToUTF8 Utf8Result(*Result);
+        return LoadModuleChunk(L, ModuleName, Utf8Result.Get(), Utf8Result.Length());
+    }
+
+    if (ScriptBundle && LoadBundledModule(L, ModuleName))
+    {
+        return LUA_OK;
+    }
+
+    FLuaModuleResolveCache::FEntry Entry;
+    if (!FLuaModuleResolveCache::Get().Find(ModuleNameStr, Entry))
+    {
+        Entry = FLuaModuleResolveCache::Resolve(ModuleNameStr);
+        FLuaModuleResolveCache::Get().Add(ModuleNameStr, Entry);
+    }
+    if (!Entry.bValidName)
+    {
+        lua_pushstring(L, "module name is invalid");
+        return LUA_ERRFILE;
+    }
+
+    //the chunk is fully built before the loader returns, so one buffer per thread serves every require
+    static thread_local TArray<uint8> FileBuffer;
+    if (!Entry.bExists || !FFileHelper::LoadFileToArray(FileBuffer, *Entry.FileName))
+    {
+        lua_pushstring(L, "module load failed");
+        return LUA_ERRFILE;
+    }
+    return LoadModuleBytes(L, ModuleName, FileBuffer);
+}
+
+static int CustomLoaderInternal(lua_State* L, bool bForceDefaultLoader)
+{
+    const char* ModuleName = luaL_checkstring(L, 1);
+    const int Status = LoadModule(L, ModuleName, bForceDefaultLoader);
+    if (Status == LUA_ERRFILE)
+    {
+        return 1; // File not found
+    }
+    if (Status != LUA_OK)
+    {
+        return lua_error(L); // raised here, where no C++ local is left to skip
+    }
+
+    lua_pushstring(L, ModuleName); // Push the file path onto the stack
+    return 2;
+}
+
+static int CustomLoader(lua_State* L)
+{
+    return CustomLoaderInternal(L, false);
+}
+
+static int CustomDefaultLoader(lua_State* L)
+{
+    return CustomLoaderInternal(L, true);
+}
+
+void RegisterCustomLoader(lua_State* L, bool bDefualt)
+{
+    lua_getglobal(L, "package");
+    lua_getfield(L, -1, "searchers");
+
+    lua_pushinteger(L, 2);
+    lua_pushcfunction(L, bDefualt ? CustomDefaultLoader : CustomLoader);
+    lua_settable(L, -3);
 
     lua_pop(L, 2); // Pop 'searchers' and 'package' tables
 }
@@ -751,11 +838,234 @@ void OnTravelLuaGCObject(GCObject* o, bool strong, lua_State* L)
     }
 }
 
+/*
+** Size class slab allocator for struct payloads that do not fit in FLuaUStructData::InnerData.
+** Blocks of one class are carved out of 64KB pages and recycled through a free list, so
+** pushing a big struct does not reach the general heap once its class is warm. Pages are
+** never released, the allocator is leaked like the custom memory slot table.
+*/
+class FLuaStructSlabAllocator
+{
+    static constexpr int32 PageSize = 64 * 1024;
+    static constexpr int32 BlockAlignment = 16;
+    static constexpr int32 SizeClasses[] = { 64, 96, 128, 160, 192, 256, 320, 384, 512, 768, 1024, 1536, 2048, 3072, 4096 };
+    static constexpr int32 NumSizeClasses = UE_ARRAY_COUNT(SizeClasses);
+
+    struct FFreeBlock
+    {
+        FFreeBlock* Next;
+    };
+
+    struct FSizeClass
+    {
+        UE::FMutex Mutex;
+        FFreeBlock* FreeList = nullptr;
+        uint8* Cursor = nullptr;
+        uint8* End = nullptr;
+    };
+
+    FSizeClass Classes[NumSizeClasses];
+
+public:
+    static FLuaStructSlabAllocator& Get()
+    {
+        static FLuaStructSlabAllocator* Instance = new FLuaStructSlabAllocator();
+        return *Instance;
+    }
+
+    void* Allocate(int32 Size, int32 Alignment, int16& OutSizeClass)
+    {
+        OutSizeClass = INDEX_NONE;
+        if(Alignment <= BlockAlignment)
+        {
+            for(int32 Index = 0; Index < NumSizeClasses; ++Index)
+            {
+                if(Size <= SizeClasses[Index])
+                {
+                    OutSizeClass = (int16)Index;
+                    break;
+                }
+            }
+        }
+        if(OutSizeClass == INDEX_NONE)
+        {
+            return FMemory::Malloc(Size, Alignment);
+        }
+
+        FSizeClass& Class = Classes[OutSizeClass];
+        UE::TUniqueLock Lock(Class.Mutex);
+        if(FFreeBlock* Block = Class.FreeList)
+        {
+            Class.FreeList = Block->Next;
+            return Block;
+        }
+        const int32 BlockSize = SizeClasses[OutSizeClass];
+        if(Class.Cursor + BlockSize > Class.End)
+        {
+            Class.Cursor = (uint8*)FMemory::Malloc(PageSize, BlockAlignment);
+            Class.End = Class.Cursor + PageSize;
+            INC_MEMORY_STAT_BY(STAT_LuaStructSlabMemory, PageSize);
+        }
+        void* Mem = Class.Cursor;
+        Class.Cursor += BlockSize;
+        return Mem;
+    }
+
+    void Free(void* Mem, int16 SizeClass)
+    {
+        if(SizeClass == INDEX_NONE)
+        {
+            FMemory::Free(Mem);
+            return;
+        }
+        FSizeClass& Class = Classes[SizeClass];
+        UE::TUniqueLock Lock(Class.Mutex);
+        FFreeBlock* Block = (FFreeBlock*)Mem;
+        Block->Next = Class.FreeList;
+        Class.FreeList = Block;
+    }
+};
+
+struct FLuaStructSpillRecord
+{
+    FString StructName;
+    int32 Size = 0;
+    int32 Alignment = 0;
+    uint64 Num = 0;
+};
+
+static UE::FMutex StructSpillMutex;
+static TMap<const UScriptStruct*, FLuaStructSpillRecord> StructSpills;
+
+static void RecordStructSpill(const UScriptStruct* Type, int32 Size)
+{
+    INC_DWORD_STAT(STAT_LuaStructSpilled);
+    if(!CVarLuaTrackStructSpills.GetValueOnAnyThread())
+    {
+        return;
+    }
+    UE::TUniqueLock Lock(StructSpillMutex);
+    FLuaStructSpillRecord& Record = StructSpills.FindOrAdd(Type);
+    if(Record.Num++ == 0)
+    {
+        Record.StructName = Type->GetPathName();
+        Record.Size = Size;
+        Record.Alignment = Type->GetMinAlignment();
+    }
+}
+
+static FAutoConsoleCommand DumpStructSpillsCommand(
+    TEXT("TurinmaLua.DumpStructSpills"),
+    TEXT("Log the structs pushed to lua that did not fit in FLuaUStructData's inline storage, most frequent first."),
+    FConsoleCommandDelegate::CreateLambda([]()
+    {
+        TArray<FLuaStructSpillRecord> Records;
+        {
+            UE::TUniqueLock Lock(StructSpillMutex);
+            StructSpills.GenerateValueArray(Records);
+        }
+        Records.Sort([](const FLuaStructSpillRecord& A, const FLuaStructSpillRecord& B) { return A.Num > B.Num; });
+        UE_LOG(LogTemp, Log, TEXT("Lua struct spills, inline size is %d bytes:"), FLuaUStructData::MaxInlineSize);
+        for(const FLuaStructSpillRecord& Record : Records)
+        {
+            UE_LOG(LogTemp, Log, TEXT("  %s: %llu spills, size %d, alignment %d"), *Record.StructName, Record.Num, Record.Size, Record.Alignment);
+        }
+    }));
+
+/*
+** Flat list of the strong UObject reference offsets of a UScriptStruct, so struct copies held by
+** lua report their references straight to the collector instead of through SerializeBin. A struct
+** the list can not describe (references inside containers or interfaces, nested structs with their
+** own AddStructReferencedObjects) is marked for the serialization path instead.
+*/
+struct FLuaStructReferenceSchema
+{
+    TWeakObjectPtr<const UScriptStruct> Struct;
+    TArray<int32> ObjectOffsets;
+    bool bSlowPath = false;
+
+    bool HasReferences() const
+    {
+        return bSlowPath || ObjectOffsets.Num() > 0;
+    }
+
+    void Build(const UStruct* InStruct, int32 BaseOffset)
+    {
+        for (TFieldIterator<FProperty> It(InStruct); It && !bSlowPath; ++It)
+        {
+            const FProperty* Property = *It;
+            const int32 ElementSize = Property->GetSize() / Property->ArrayDim;
+            for (int32 ArrayIndex = 0; ArrayIndex < Property->ArrayDim && !bSlowPath; ++ArrayIndex)
+            {
+                const int32 Offset = BaseOffset + Property->GetOffset_ForInternal() + ArrayIndex * ElementSize;
+                if (CastField<FObjectProperty>(Property))
+                {
+                    ObjectOffsets.Add(Offset);
+                }
+                else if (const FStructProperty* StructProperty = CastField<FStructProperty>(Property))
+                {
+                    if (StructProperty->Struct->StructFlags & STRUCT_AddStructReferencedObjects)
+                    {
+                        bSlowPath = true;
+                    }
+                    else
+                    {
+                        Build(StructProperty->Struct, Offset);
+                    }
+                }
+                else
+                {
+                    TArray<const FStructProperty*> EncounteredStructProps;
+                    bSlowPath = Property->ContainsObjectReference(EncounteredStructProps, EPropertyObjectReferenceType::Strong);
+                }
+            }
+        }
+    }
+};
+
+static UE::FMutex StructReferenceSchemaMutex;
+static TMap<const UScriptStruct*, FLuaStructReferenceSchema*> StructReferenceSchemas;
+/** Append only, FLuaUStructData::RefSchema may still point at a schema whose map entry was rebuilt */
+static TArray<TUniquePtr<FLuaStructReferenceSchema>> StructReferenceSchemaStorage;
+
+static const FLuaStructReferenceSchema* GetStructReferenceSchema(const UScriptStruct* Type)
+{
+    UE::TUniqueLock Lock(StructReferenceSchemaMutex);
+    FLuaStructReferenceSchema*& Schema = StructReferenceSchemas.FindOrAdd(Type);
+    //a stale entry belongs to a destroyed struct that happened to have the same address
+    if (!Schema || Schema->Struct.Get() != Type)
+    {
+        Schema = StructReferenceSchemaStorage.Add_GetRef(MakeUnique<FLuaStructReferenceSchema>()).Get();
+        Schema->Struct = Type;
+        if (Type->StructFlags & STRUCT_AddStructReferencedObjects)
+        {
+            Schema->bSlowPath = true;
+        }
+#if WITH_EDITOR
+        //user defined structs can change layout in place when recompiled
+        else if (!(Type->StructFlags & STRUCT_Native))
+        {
+            Schema->bSlowPath = true;
+        }
+#endif
+        else
+        {
+            Schema->Build(Type, 0);
+        }
+    }
+    return Schema;
+}
+
 void FLuaUStructData::Clear()
 {
     if (StructType && bValid)
     {
-        StructType->DestroyStruct(GetData());
+        void* Mem = GetData();
+        StructType->DestroyStruct(Mem);
+        if(!bInline)
+        {
+            FLuaStructSlabAllocator::Get().Free(Mem, SizeClass);
+        }
     }
     StructType = nullptr;
     bValid = false;
@@ -769,50 +1079,80 @@ void FLuaUStructData::CopyData(void* Data)
     }
 }
 
-void FLuaUStructData::SetData(UScriptStruct* Type, void* Data)
+/* construct Dest as a copy of Src, without first filling it with the defaults a copy would overwrite */
+static void CopyConstructStruct(UScriptStruct* Type, void* Dest, const void* Src)
 {
-	if(StructType && bValid)
-	{
-        StructType->DestroyStruct(GetData());
-	}
-    StructType = Type;
-    bValid = false;
-
-    if(StructType)
+    if (Type->StructFlags & STRUCT_IsPlainOldData)
     {
-        if (StructType->GetStructureSize() > MaxInlineSize)
+        FMemory::Memcpy(Dest, Src, Type->GetStructureSize());
+    }
+    else if (!Type->GetCppStructOps())
+    {
+        //every member of a script struct is a property, so each one can be copy constructed on its own
+        FMemory::Memzero(Dest, Type->GetStructureSize());
+        for (FProperty* Property = Type->PropertyLink; Property; Property = Property->PropertyLinkNext)
         {
-            void* Mem = operator new(StructType->GetStructureSize());
-            StructType->InitializeDefaultValue((uint8*)Mem);
-            if(Data)
+            if (Property->HasAnyPropertyFlags(CPF_IsPlainOldData))
             {
-                StructType->CopyScriptStruct(Mem, Data);
+                FMemory::Memcpy(Property->ContainerPtrToValuePtr<void>(Dest), Property->ContainerPtrToValuePtr<void>(Src), Property->GetSize());
+                continue;
             }
-        	*(void**)(&InnerData) = Mem;
-        }
-        else
-        {
-            StructType->InitializeDefaultValue((uint8*)&InnerData);
-            if(Data)
+            if (!Property->HasAnyPropertyFlags(CPF_ZeroConstructor))
             {
-                StructType->CopyScriptStruct(&InnerData, Data);
+                Property->InitializeValue_InContainer(Dest);
             }
+            Property->CopyCompleteValue_InContainer(Dest, Src);
         }
-        bValid = true;
+    }
+    else
+    {
+        //native structs may have members reflection does not see, only their constructor and operator= are reachable
+        Type->InitializeStruct(Dest);
+        Type->CopyScriptStruct(Dest, Src);
     }
 }
 
-void* FLuaUStructData::GetData()
+void FLuaUStructData::SetData(UScriptStruct* Type, void* Data, bool bMove)
 {
-    if(StructType && bValid)
+    Clear();
+    StructType = Type;
+
+    if(StructType)
     {
-        if (StructType->GetStructureSize() > MaxInlineSize)
+        DataSize = StructType->GetStructureSize();
+        const int32 Alignment = StructType->GetMinAlignment();
+        bInline = DataSize <= MaxInlineSize && Alignment <= alignof(std::max_align_t);
+        RefSchema = GetStructReferenceSchema(StructType);
+
+        void* Mem = &InnerData;
+        if(bInline)
+        {
+            INC_DWORD_STAT(STAT_LuaStructInline);
+        }
+        else
+        {
+            Mem = FLuaStructSlabAllocator::Get().Allocate(DataSize, Alignment, SizeClass);
+            *(void**)(&InnerData) = Mem;
+            RecordStructSpill(StructType, DataSize);
+        }
+
+        if(!Data)
+        {
+            StructType->InitializeDefaultValue((uint8*)Mem);
+        }
+        else if(bMove)
         {
-            return *(void**)(&InnerData);
+            //UE types are bitwise relocatable, TArray relies on it too, so the heap buffers change owner with the bytes
+            //and the source is constructed again for its owner to destroy
+            FMemory::Memcpy(Mem, Data, DataSize);
+            StructType->InitializeStruct(Data);
         }
-        return &InnerData;
+        else
+        {
+            CopyConstructStruct(StructType, Mem, Data);
+        }
+        bValid = true;
     }
-    return nullptr;
 }
 
 void FLuaUStructData::AddReferencedObjects(UObject* Owner, FReferenceCollector& Collector, bool bStrong)
@@ -820,10 +1160,21 @@ void FLuaUStructData::AddReferencedObjects(UObject* Owner, FReferenceCollector&
     if(StructType)
     {
         Collector.AddReferencedObject(StructType);
-        if(bValid)
+        if(bValid && RefSchema->HasReferences())
         {
-            FVerySlowReferenceCollectorArchiveScope Scope(Collector.GetVerySlowReferenceCollectorArchive(), Owner);
-            StructType->SerializeBin(Scope.GetArchive(), GetData());
+            uint8* Data = (uint8*)GetData();
+            if(RefSchema->bSlowPath)
+            {
+                FVerySlowReferenceCollectorArchiveScope Scope(Collector.GetVerySlowReferenceCollectorArchive(), Owner);
+                StructType->SerializeBin(Scope.GetArchive(), Data);
+            }
+            else
+            {
+                for(const int32 Offset : RefSchema->ObjectOffsets)
+                {
+                    Collector.AddReferencedObject(*(UObject**)(Data + Offset), Owner);
+                }
+            }
         }
 
     }
@@ -843,30 +1194,123 @@ void FLuaUObjectData::AddReferencedObjects(UObject* Owner, FReferenceCollector&
 
 void ULuaState::PostGarbageCollect()
 {
-    if(InnerState)
+    if(InnerState && GCMode == ELuaGCMode::StopTheWorld)
     {
         lua_gc(InnerState, LUA_GCCOLLECT);
         lua_gc(InnerState, LUA_GCSTOP);
     }
 }
 
-void ULuaState::OnCollectLuaRefs(FReferenceCollector& Collector, GCObject* o, bool w, lua_State* l)
+void ULuaState::OnLuaAllocated(SIZE_T Bytes)
 {
-    if(o->tt == LUA_VUSERDATA)
+    AllocatedSinceGCStep += Bytes;
+    if(!bGCPressure && GCPressureKB > 0 && InnerState && GCMode != ELuaGCMode::StopTheWorld
+        && AllocatedSinceGCStep > (SIZE_T)GCPressureKB * 1024)
     {
-        Udata* u = gco2u(o);
-        if (u->nuvalue != 0 && u->metatable)
-        {  
-            auto metatableName = GetMetatableName(l, u->metatable);
-            if(metatableName && strcmp(metatableName, LuaUEDataMetatableName) == 0)
-            {
-                void* UD = getudatamem(u);
-                FLuaUEData* UEData = (FLuaUEData*)UD;
-                if(UEData)
-                {
-                    UEData->AddReferencedObjects(this, Collector, w);
-                }
+        //only recorded, the allocator may run inside lua_gc, which restores gcstp when it returns
+        bGCPressure = true;
+        INC_DWORD_STAT(STAT_LuaGCPressure);
+    }
+}
+
+bool ULuaState::IsTickable() const
+{
+    return InnerState && bTickGC;
+}
+
+void ULuaState::Tick(float DeltaTime)
+{
+    StepGC(GCBudgetMicroseconds);
+    ReportMemory();
+}
+
+void ULuaState::StepGC(float BudgetMicroseconds)
+{
+    if(!InnerState || GCMode == ELuaGCMode::StopTheWorld)
+    {
+        return;
+    }
+
+    SCOPE_CYCLE_COUNTER(STAT_LuaGCStep);
+    lua_lock(InnerState);
+    if(bGCRunning)
+    {
+        lua_gc(InnerState, LUA_GCSTOP);
+        bGCRunning = false;
+    }
+    global_State* g = G(InnerState);
+    if(GCMode == ELuaGCMode::Generational)
+    {
+        //a generational step is a whole young collection, it can not be split to fit a budget
+        if(AllocatedSinceGCStep > 0)
+        {
+            INC_DWORD_STAT(STAT_LuaGCSteps);
+            lua_gc(InnerState, LUA_GCSTEP, 0);
+        }
+    }
+    else if(g->gcstate != GCSpause || gettotalbytes(g) >= (g->GCestimate / 100) * getgcparam(g->gcpause))
+    {
+        //same threshold lua itself uses to start a new cycle
+        const uint64 EndCycles = FPlatformTime::Cycles64() + (uint64)(BudgetMicroseconds * 1e-6 / FPlatformTime::GetSecondsPerCycle64());
+        do
+        {
+            INC_DWORD_STAT(STAT_LuaGCSteps);
+            if(lua_gc(InnerState, LUA_GCSTEP, 0))
+            {
+                break; //finished a cycle, the next one waits for the heap to grow again
             }
+        } while(FPlatformTime::Cycles64() < EndCycles);
+    }
+
+    if(bGCPressure)
+    {
+        //let the collector's own debt driven steps run on allocation until the next step stops it again
+        lua_gc(InnerState, LUA_GCRESTART);
+        bGCRunning = true;
+        bGCPressure = false;
+    }
+    AllocatedSinceGCStep = 0;
+
+    lua_unlock(InnerState);
+}
+
+bool ULuaState::CanAllocate(SIZE_T Bytes) const
+{
+    //lua_newstate must not fail halfway, the limit applies from the first allocation after it
+    if(MemoryLimitKB <= 0 || !InnerState || (SIZE_T)GetAllocatedBytes() + Bytes <= (SIZE_T)MemoryLimitKB * 1024)
+    {
+        return true;
+    }
+    INC_DWORD_STAT(STAT_LuaMemoryLimitHits);
+    return false;
+}
+
+void ULuaState::ReportMemory()
+{
+    const int64 HeapBytes = GetAllocatedBytes();
+#if STATS
+    if(HeapBytes > ReportedHeapBytes)
+    {
+        INC_MEMORY_STAT_BY(STAT_LuaHeapSize, HeapBytes - ReportedHeapBytes);
+    }
+    else
+    {
+        DEC_MEMORY_STAT_BY(STAT_LuaHeapSize, ReportedHeapBytes - HeapBytes);
+    }
+#endif
+    ReportedHeapBytes = HeapBytes;
+    CSV_CUSTOM_STAT(TurinmaLua, LuaHeapMB, (float)((double)HeapBytes / (1024.0 * 1024.0)), ECsvCustomStatOp::Accumulate);
+}
+
+void ULuaState::OnCollectLuaRefs(FReferenceCollector& Collector, GCObject* o, bool w, lua_State* l)
+{
+    if(o->tt == LUA_VUSERDATA)
+    {
+        Udata* u = gco2u(o);
+        if (IsUEDataMetatable(u->metatable))
+        {
+            FLuaUEData* UEData = (FLuaUEData*)getudatamem(u);
+            UEData->AddReferencedObjects(this, Collector, w);
         }
     }
 }
@@ -876,39 +1320,139 @@ void ULuaState::OnCollectLuaRefs(FReferenceCollector& Collector, GCObject* o, bo
 static std::atomic_uint64_t GlobalThreadId = 0;
 
 thread_local uint64 ULuaState::LocalThreadId = 0xffffffffffffffff;
-thread_local uint64 ULuaState::EnterCount = 0;
 
-void ULuaState::LockLua()
+uint64 ULuaState::GetLocalThreadId()
 {
     if(LocalThreadId == 0xffffffffffffffff)
     {
         LocalThreadId = GlobalThreadId.fetch_add(1);
     }
+    return LocalThreadId;
+}
+
+void ULuaState::LockLua()
+{
+    const uint64 ThreadId = GetLocalThreadId();
+    if(ThreadingMode == ELuaThreadingMode::SingleThread)
+    {
+        //reference collection may run on gc worker threads while the owner is blocked in the collector
+        checkf(ThreadId == OwnerThreadId || IsGarbageCollecting(), TEXT("single thread lua state entered from another thread"));
+        return;
+    }
 
-    if(LocalThreadId == LockedThreadId)
+    //only this thread can have stored its own id, so a relaxed load is enough to detect reentrance
+    if(ThreadId == LockedThreadId.load(std::memory_order_relaxed))
     {
         EnterCount++;
+        return;
     }
-    else
+
+    if(!LuaMutex.TryLock())
     {
-        while (LuaAt.test_and_set()) {}
-        LockedThreadId = LocalThreadId;
-        EnterCount = 1;
+        if(ThreadingMode == ELuaThreadingMode::DebugContention)
+        {
+            const uint64 StartCycles = FPlatformTime::Cycles64();
+            LuaMutex.Lock();
+            ContendedLockNum.fetch_add(1, std::memory_order_relaxed);
+            ContendedLockCycles.fetch_add(FPlatformTime::Cycles64() - StartCycles, std::memory_order_relaxed);
+            INC_DWORD_STAT(STAT_LuaLockContended);
+        }
+        else
+        {
+            LuaMutex.Lock();
+        }
     }
+    LockedThreadId.store(ThreadId, std::memory_order_relaxed);
+    EnterCount = 1;
 }
 
 void ULuaState::UnlockLua()
 {
+    if(ThreadingMode == ELuaThreadingMode::SingleThread)
+    {
+        return;
+    }
     if(--EnterCount == 0)
     {
-        LockedThreadId = 0xffffffffffffffff;
-        LuaAt.clear();
+        LockedThreadId.store(0xffffffffffffffff, std::memory_order_relaxed);
+        LuaMutex.Unlock();
     }
 }
 
-void ULuaState::PushLuaUEData(void* Value, UStruct* DataType, EUEDataType Type, TCustomMemoryHandle<FLuaUEData> Oter)
+/* same as lua_setmetatable on the userdata at the top of the stack, with an already resolved metatable */
+static void setudatametatable(lua_State* L, Table* mt)
 {
-    if(!InnerState)
+    lua_lock(L);
+    Udata* u = uvalue(s2v(L->top.p - 1));
+    u->metatable = mt;
+    luaC_objbarrier(L, u, mt);
+    luaC_checkfinalizer(L, obj2gco(u), mt);
+    lua_unlock(L);
+}
+
+void ULuaState::RegisterUEData(FLuaUEData* LuaUD)
+{
+    lua_lock(InnerState);
+    LuaUD->RegistryIndex = LiveUEData.Add({ LuaUD, true });
+    lua_unlock(InnerState);
+}
+
+void ULuaState::UnregisterUEData(FLuaUEData* LuaUD)
+{
+    const int32 Index = LuaUD->RegistryIndex;
+    if (Index == INDEX_NONE)
+    {
+        return;
+    }
+    lua_lock(InnerState);
+    check(LiveUEData[Index].UEData == LuaUD);
+    LiveUEData.RemoveAtSwap(Index, 1, EAllowShrinking::No);
+    if (LiveUEData.IsValidIndex(Index))
+    {
+        LiveUEData[Index].UEData->RegistryIndex = Index;
+    }
+    LuaUD->RegistryIndex = INDEX_NONE;
+    lua_unlock(InnerState);
+}
+
+FLuaUEData* ToUEData(lua_State* L, int Index);
+
+void ULuaState::SetUEDataStrong(int32 Index, bool bStrong)
+{
+    //pseudo indices do not point into the stack, UE userdata are only ever passed on it
+    if (!InnerState || Index <= LUA_REGISTRYINDEX)
+    {
+        return;
+    }
+    LockLua();
+    Index = lua_absindex(InnerState, Index);
+    FLuaUEData* LuaUD = Index >= 1 ? ToUEData(InnerState, Index) : nullptr;
+    if (!LuaUD || LuaUD->RegistryIndex == INDEX_NONE)
+    {
+        UnlockLua();
+        return;
+    }
+
+    lua_getfield(InnerState, LUA_REGISTRYINDEX, bStrong ? UObjectExtensionStrongTableName : UObjectExtensionWeakTableName);//to
+    lua_pushvalue(InnerState, Index);//to, ud
+    lua_pushboolean(InnerState, true);//to, ud, true
+    lua_rawset(InnerState, -3);//to
+
+    lua_getfield(InnerState, LUA_REGISTRYINDEX, bStrong ? UObjectExtensionWeakTableName : UObjectExtensionStrongTableName);//to, from
+    lua_pushvalue(InnerState, Index);//to, from, ud
+    lua_pushnil(InnerState);//to, from, ud, nil
+    lua_rawset(InnerState, -3);//to, from
+    lua_pop(InnerState, 2);
+
+    LiveUEData[LuaUD->RegistryIndex].bStrong = bStrong;
+    UnlockLua();
+}
+
+void ULuaState::PushLuaUEData(lua_State* L, void* Value, UStruct* DataType, EUEDataType Type, TCustomMemoryHandle<FLuaUEData> Oter, bool bMove)
+{
+    SCOPE_CYCLE_COUNTER(STAT_LuaPushUEData);
+    //C++ callers may push many values in a row, the cache hit below writes the stack directly and building a metatable needs five slots
+    if(!InnerState || !UEDataMetatable || !lua_checkstack(L, 5))
     {
         return;
     }
@@ -957,7 +1501,34 @@ void ULuaState::PushLuaUEData(void* Value, UStruct* DataType, EUEDataType Type,
             return;
         }
 
-        FLuaUEData* LuaUD = (FLuaUEData*)lua_newuserdata(InnerState, sizeof(FLuaUEData));//ud
+        Table* Metatable = GetTypeMetatable(L, Obj ? (UStruct*)Obj->GetClass() : DataType);
+
+        //an object already alive in lua is pushed as the same userdata, so == and table keys work on it
+        if(Obj)
+        {
+            lua_lock(L);
+            TValue Key;
+            setpvalue(&Key, Obj);
+            const TValue* Cached = luaH_get(UObjectCache, &Key);
+            //a different metatable means the class was reinstanced since, that userdata keeps its old accessors
+            if(ttisfulluserdata(Cached) && uvalue(Cached)->metatable == Metatable)
+            {
+                const FLuaUEData* CachedData = (const FLuaUEData*)getudatamem(uvalue(Cached));
+                if(CachedData->DataType == EUEDataType::Object && CachedData->Data.Object.Object == Obj)
+                {
+                    setuvalue(L, s2v(L->top.p), uvalue(Cached));
+                    L->top.p++;
+                    lua_unlock(L);
+                    INC_DWORD_STAT(STAT_LuaUObjectCacheHits);
+                    return;
+                }
+            }
+            lua_unlock(L);
+            INC_DWORD_STAT(STAT_LuaUObjectCacheMisses);
+        }
+
+        //the user value of a view holds its owner's userdata, see PushUStructRef
+        FLuaUEData* LuaUD = (FLuaUEData*)lua_newuserdatauv(L, sizeof(FLuaUEData), 1);//ud
         new (LuaUD) FLuaUEData();
         if(!LuaUD)
         {
@@ -965,10 +1536,11 @@ void ULuaState::PushLuaUEData(void* Value, UStruct* DataType, EUEDataType Type,
         }
 
         LuaUD->DataType = Type;
-        LuaUD->Oter = Oter;
+        LuaUD->Oter = TTrustedCustomMemoryHandle<FLuaUEData>(Oter);
+
+        setudatametatable(L, Metatable);//ud
 
-        luaL_newmetatable(InnerState, LuaUEDataMetatableName); //ud, LuaUEDataMetatableName
-        lua_setmetatable(InnerState, -2);//ud
+        RegisterUEData(LuaUD);
 
 	    switch (Type)
 	    {
@@ -984,21 +1556,105 @@ void ULuaState::PushLuaUEData(void* Value, UStruct* DataType, EUEDataType Type,
             break;
 	    case EUEDataType::Struct:
 		    {
-            LuaUD->Data.Struct.SetData(ScriptStruct, Value);
+            LuaUD->Data.Struct.SetData(ScriptStruct, Value, bMove);
 		    }
             break;
 	    default:
             check(0);
 	    }
+
+        if(Obj)
+        {
+            lua_getfield(L, LUA_REGISTRYINDEX, UObjectCacheTableName);//ud, cache
+            lua_pushvalue(L, -2);//ud, cache, ud
+            lua_rawsetp(L, -2, Obj);//ud, cache
+            lua_pop(L, 1);//ud
+        }
+    }
+}
+
+/** What PushLuaUEDataProtected hands to PushUEDataCall through lua_pcall */
+struct FUEDataPush
+{
+    ULuaState* LuaState;
+    void* Value;
+    UStruct* DataType;
+    EUEDataType Type;
+    bool bMove;
+};
+
+int PushUEDataCall(lua_State* L)
+{
+    const FUEDataPush* Push = (const FUEDataPush*)lua_touserdata(L, 1);
+    Push->LuaState->PushLuaUEData(L, Push->Value, Push->DataType, Push->Type, nullptr, Push->bMove);
+    return lua_gettop(L) - 1;
+}
+
+void ULuaState::PushLuaUEDataProtected(void* Value, UStruct* DataType, EUEDataType Type, bool bMove)
+{
+    //a memory error raised outside any lua_pcall would reach the panic handler and abort
+    if(!InnerState || !lua_checkstack(InnerState, 2))
+    {
+        return;
+    }
+    FUEDataPush Push{ this, Value, DataType, Type, bMove };
+    lua_pushcfunction(InnerState, PushUEDataCall);
+    lua_pushlightuserdata(InnerState, &Push);
+    if(lua_pcall(InnerState, 1, LUA_MULTRET, 0) != LUA_OK)
+    {
+        UE_LOG(LogTemp, Error, TEXT("LuaState %s: %s"), *GetName(), lua_isstring(InnerState, -1) ? UTF8_TO_TCHAR(lua_tostring(InnerState, -1)) : TEXT("can not push the UE data"));
+        lua_pop(InnerState, 1);
     }
 }
 
 void ULuaState::PushUStructCopy(void* Value, UScriptStruct* DataType)
 {
-    PushLuaUEData(Value, DataType, EUEDataType::Struct, nullptr);
+    PushLuaUEDataProtected(Value, DataType, EUEDataType::Struct);
+}
+
+void ULuaState::PushUStructMove(void* Value, UScriptStruct* DataType)
+{
+    PushLuaUEDataProtected(Value, DataType, EUEDataType::Struct, true);
+}
+
+void ULuaState::PushUStructRef(lua_State* L, void* Value, UScriptStruct* Struct, int OwnerIndex)
+{
+    OwnerIndex = lua_absindex(L, OwnerIndex);
+    FLuaUEData* Owner = ToUEData(L, OwnerIndex);
+    if(!Owner || !lua_checkstack(L, 2))
+    {
+        return;
+    }
+    const int Top = lua_gettop(L);
+    //a view into a view borrows from the same owner, so checking a view never walks a chain of owners
+    if(Owner->DataType == EUEDataType::StructRef)
+    {
+        lua_getiuservalue(L, OwnerIndex, 1);//owner
+        Owner = Owner->Oter.IsSet() ? Owner->Oter.GetValue().Get() : nullptr;
+    }
+    else
+    {
+        lua_pushvalue(L, OwnerIndex);//owner
+    }
+    if(Owner)
+    {
+        PushLuaUEData(L, Value, Struct, EUEDataType::StructRef, TCustomMemoryHandle<FLuaUEData>(Owner));//owner, view
+    }
+    if(lua_gettop(L) != Top + 2)
+    {
+        lua_settop(L, Top);
+        return;
+    }
+    //the view roots its owner, the owner's data can not be finalized while the view is reachable
+    lua_insert(L, -2);//view, owner
+    lua_setiuservalue(L, -2, 1);//view
 }
 
 const char* const ULuaState::LuaUEDataMetatableName = MAKE_LUA_METATABLE_NAME(FLuaUEData);
+const char* const ULuaState::UObjectExtensionWeakTableName = "InternalUseOnly___*___UObjectExtensionWeakTable";
+const char* const ULuaState::UObjectExtensionStrongTableName = "InternalUseOnly___*___UObjectExtensionStrongTable";
+const char* const ULuaState::UEDataMetatableTableName = "InternalUseOnly___*___UEDataMetatableTable";
+const char* const ULuaState::UObjectCacheTableName = "InternalUseOnly___*___UObjectCacheTable";
 void ULuaState::BeginDestroy()
 {
 	UObject::BeginDestroy();
@@ -1030,169 +1686,1142 @@ int TurinmaTableNewIndex(lua_State* L)
 }
 
 
-int OnDestroyUEDataInLua(lua_State* L)
+static int GetIntProperty(ULuaState* LuaState, lua_State* L, FLuaUEData* Owner, void* Value, const FProperty* Property)
+{
+    lua_pushinteger(L, *(int32*)Value);
+    return 1;
+}
+
+static bool SetIntProperty(lua_State* L, int Index, void* Value, const FProperty* Property)
 {
-    lua_getmetatable(L, 1);//obj, metatable
-    lua_getfield(L, -1, "__name");//obj, metatable, LuaUEDataMetatableName
-    if(ensure(strcmp(lua_tostring(L, -1), ULuaState::LuaUEDataMetatableName) == 0))
+    int IsNum = 0;
+    const lua_Integer Integer = lua_tointegerx(L, Index, &IsNum);
+    if (IsNum)
     {
-        FLuaUEData* LuaUEData = (FLuaUEData*)lua_touserdata(L, 1);
-        LuaUEData->~FLuaUEData();
+        *(int32*)Value = (int32)Integer;
     }
-    return 0;
+    return IsNum != 0;
 }
 
-void ULuaState::Init()
+static int GetIntegerProperty(ULuaState* LuaState, lua_State* L, FLuaUEData* Owner, void* Value, const FProperty* Property)
 {
-    LuaAt.clear();
-    InnerState = lua_newstate(&FLuaSourceModule::LuaMalloc, this);
-    lua_gc(InnerState, LUA_GCSTOP);
-    luaL_openlibs(InnerState);
-
-    RegisterCustomLoader(InnerState, true);
+    lua_pushinteger(L, ((const FNumericProperty*)Property)->GetSignedIntPropertyValue(Value));
+    return 1;
+}
 
-    lua_newtable(InnerState);//TurinmaTable
-    lua_newtable(InnerState);//TurinmaTable, metatable
-    //lua_pushcfunction(InnerState,)
+static bool SetIntegerProperty(lua_State* L, int Index, void* Value, const FProperty* Property)
+{
+    int IsNum = 0;
+    const lua_Integer Integer = lua_tointegerx(L, Index, &IsNum);
+    if (IsNum)
+    {
+        ((const FNumericProperty*)Property)->SetIntPropertyValue(Value, (int64)Integer);
+    }
+    return IsNum != 0;
+}
 
+static int GetFloatProperty(ULuaState* LuaState, lua_State* L, FLuaUEData* Owner, void* Value, const FProperty* Property)
+{
+    lua_pushnumber(L, *(float*)Value);
+    return 1;
+}
 
-    //lua_setglobal(InnerState, );
+static bool SetFloatProperty(lua_State* L, int Index, void* Value, const FProperty* Property)
+{
+    int IsNum = 0;
+    const lua_Number Number = lua_tonumberx(L, Index, &IsNum);
+    if (IsNum)
+    {
+        *(float*)Value = (float)Number;
+    }
+    return IsNum != 0;
+}
 
-    lua_getglobal(InnerState, "require");
-    lua_pushstring(InnerState, "TurinmaLua.Core.Init");
+static int GetDoubleProperty(ULuaState* LuaState, lua_State* L, FLuaUEData* Owner, void* Value, const FProperty* Property)
+{
+    lua_pushnumber(L, *(double*)Value);
+    return 1;
+}
 
-    
-    lua_pcall(InnerState, 1, LUA_MULTRET,0);
-    lua_pop(InnerState, lua_gettop(InnerState));
+static bool SetDoubleProperty(lua_State* L, int Index, void* Value, const FProperty* Property)
+{
+    int IsNum = 0;
+    const lua_Number Number = lua_tonumberx(L, Index, &IsNum);
+    if (IsNum)
+    {
+        *(double*)Value = Number;
+    }
+    return IsNum != 0;
+}
 
-    RegisterCustomLoader(InnerState, false);
+static int GetBoolProperty(ULuaState* LuaState, lua_State* L, FLuaUEData* Owner, void* Value, const FProperty* Property)
+{
+    lua_pushboolean(L, ((const FBoolProperty*)Property)->GetPropertyValue(Value));
+    return 1;
+}
 
-    AddUsefulLuaTableWithMetatableToTable(InnerState, "InternalUseOnly___*___UObjectExtensionWeakTable", LUA_REGISTRYINDEX, true);
-    AddUsefulLuaTableWithMetatableToTable(InnerState, "InternalUseOnly___*___UObjectExtensionStrongTable", LUA_REGISTRYINDEX, false);
+static bool SetBoolProperty(lua_State* L, int Index, void* Value, const FProperty* Property)
+{
+    ((const FBoolProperty*)Property)->SetPropertyValue(Value, lua_toboolean(L, Index) != 0);
+    return true;
+}
 
-    lua_pop(InnerState, lua_gettop(InnerState));
+//enums are stored in their underlying integer, uint8 for FByteProperty and almost every FEnumProperty
+static int GetByteEnumProperty(ULuaState* LuaState, lua_State* L, FLuaUEData* Owner, void* Value, const FProperty* Property)
+{
+    lua_pushinteger(L, *(uint8*)Value);
+    return 1;
+}
 
-    luaL_newmetatable(InnerState, LuaUEDataMetatableName); // LuaUEDataMetatableName
+static bool SetByteEnumProperty(lua_State* L, int Index, void* Value, const FProperty* Property)
+{
+    int IsNum = 0;
+    const lua_Integer Integer = lua_tointegerx(L, Index, &IsNum);
+    if (IsNum)
+    {
+        *(uint8*)Value = (uint8)Integer;
+    }
+    return IsNum != 0;
+}
 
-    lua_pushstring(InnerState, "__gc");
-    lua_pushcfunction(InnerState, OnDestroyUEDataInLua);
-    lua_rawset(InnerState, -3);
+static int GetEnumProperty(ULuaState* LuaState, lua_State* L, FLuaUEData* Owner, void* Value, const FProperty* Property)
+{
+    lua_pushinteger(L, ((const FEnumProperty*)Property)->GetUnderlyingProperty()->GetSignedIntPropertyValue(Value));
+    return 1;
+}
 
-    //todo finalize LuaUEDataMetatableName
-    lua_pop(InnerState, 1);
-    
-    FCoreUObjectDelegates::GetPostGarbageCollect().AddUObject(this, &ULuaState::PostGarbageCollect);
+static bool SetEnumProperty(lua_State* L, int Index, void* Value, const FProperty* Property)
+{
+    int IsNum = 0;
+    const lua_Integer Integer = lua_tointegerx(L, Index, &IsNum);
+    if (IsNum)
+    {
+        ((const FEnumProperty*)Property)->GetUnderlyingProperty()->SetIntPropertyValue(Value, (int64)Integer);
+    }
+    return IsNum != 0;
+}
 
+/** Converts straight into lua memory, so a memory error raised by the push leaves no converted copy behind */
+static void PushTCHARString(lua_State* L, const TCHAR* String, int32 Length)
+{
+    const int32 ConvertedLength = FPlatformString::ConvertedLength<UTF8CHAR>(String, Length);
+    luaL_Buffer Buffer;
+    char* Dest = luaL_buffinitsize(L, &Buffer, ConvertedLength);
+    FPlatformString::Convert((UTF8CHAR*)Dest, ConvertedLength, String, Length);
+    luaL_pushresultsize(&Buffer, ConvertedLength);
+}
 
-    LuaCPPAPI::luaC_foreachgcobj(InnerState, OnTravelLuaGCObject);
+static int GetNameProperty(ULuaState* LuaState, lua_State* L, FLuaUEData* Owner, void* Value, const FProperty* Property)
+{
+    //inline storage, names never outgrow it
+    TStringBuilder<FName::StringBufferSize> Name;
+    ((const FName*)Value)->AppendString(Name);
+    PushTCHARString(L, Name.GetData(), Name.Len());
+    return 1;
 }
 
-void ULuaState::Finalize()
+static bool SetNameProperty(lua_State* L, int Index, void* Value, const FProperty* Property)
 {
-    if(InnerState)
+    if (lua_type(L, Index) != LUA_TSTRING)
     {
-        FCoreUObjectDelegates::GetPostGarbageCollect().RemoveAll(this);
-        lua_close(InnerState);
-        InnerState = nullptr;
+        return false;
     }
+    *(FName*)Value = FName(UTF8_TO_TCHAR(lua_tostring(L, Index)));
+    return true;
 }
 
-void ULuaState::Pop(int32 Num)
+static int GetStrProperty(ULuaState* LuaState, lua_State* L, FLuaUEData* Owner, void* Value, const FProperty* Property)
 {
-    if (InnerState)
+    const FString& String = *(const FString*)Value;
+    PushTCHARString(L, *String, String.Len());
+    return 1;
+}
+
+static bool SetStrProperty(lua_State* L, int Index, void* Value, const FProperty* Property)
+{
+    if (lua_type(L, Index) != LUA_TSTRING)
     {
-        int32 MaxPop = lua_gettop(InnerState);
-        int32 P = FMath::Min(Num, MaxPop);
-        if(P > 0)
-        {
-            lua_pop(InnerState, P);
-        }
+        return false;
     }
+    *(FString*)Value = UTF8_TO_TCHAR(lua_tostring(L, Index));
+    return true;
 }
 
-void ULuaState::AddReferencedObjects(UObject* InThis, FReferenceCollector& Collector)
+static int GetObjectProperty(ULuaState* LuaState, lua_State* L, FLuaUEData* Owner, void* Value, const FProperty* Property)
 {
-    ULuaState* This = CastChecked<ULuaState>(InThis);
-
-    if(This->InnerState)
+    const int Top = lua_gettop(L);
+    if (UObject* Object = ((const FObjectProperty*)Property)->GetObjectPropertyValue(Value))
     {
-        LuaCPPAPI::luaC_foreachgcobj(This->InnerState, [This, &Collector](GCObject* o, bool w, lua_State* l)->void
-            {
-                This->OnCollectLuaRefs(Collector, o, w, l);
-            });
+        LuaState->PushUObject(L, Object);
     }
+    if (lua_gettop(L) == Top)
+    {
+        lua_pushnil(L);
+    }
+    return 1;
 }
 
-void LuaLock(lua_State* L)
+static bool SetObjectProperty(lua_State* L, int Index, void* Value, const FProperty* Property)
 {
-    if (G(L)->ud)
+    const FObjectProperty* ObjectProperty = (const FObjectProperty*)Property;
+    if (lua_isnil(L, Index))
+    {
+        ObjectProperty->SetObjectPropertyValue(Value, nullptr);
+        return true;
+    }
+
+    FLuaUEData* SourceData = ToUEData(L, Index);
+    UObject* Object = SourceData && SourceData->DataType == EUEDataType::Object ? SourceData->Data.Object.Object : nullptr;
+    if (!Object || !Object->IsA(ObjectProperty->PropertyClass))
+    {
+        return false;
+    }
+    if (const FClassProperty* ClassProperty = CastField<FClassProperty>(Property))
     {
-        ULuaState* LuaState = (ULuaState*)(G(L)->ud);
-        LuaState->LockLua();
+        if (!((UClass*)Object)->IsChildOf(ClassProperty->MetaClass))
+        {
+            return false;
+        }
     }
+    ObjectProperty->SetObjectPropertyValue(Value, Object);
+    return true;
 }
 
-void LuaUnLock(lua_State* L)
+static int GetStructProperty(ULuaState* LuaState, lua_State* L, FLuaUEData* Owner, void* Value, const FProperty* Property)
 {
-    if(G(L)->ud)
+    //math structs stay views too, obj.Location.X = 1 writes through, only call results are UEMath copies
+    const int Top = lua_gettop(L);
+    if (Owner)
+    {
+        LuaState->PushUStructRef(L, Value, ((const FStructProperty*)Property)->Struct, 1);
+    }
+    if (lua_gettop(L) == Top)
     {
-        ULuaState* LuaState = (ULuaState*)(G(L)->ud);
-        LuaState->UnlockLua();
+        lua_pushnil(L);
     }
+    return 1;
 }
 
-void FLuaSourceModule::StartupModule()
+static bool SetStructProperty(lua_State* L, int Index, void* Value, const FProperty* Property)
 {
-	// This code will execute after your module is loaded into memory; the exact timing is specified in the .uplugin file per-module
-    //FCoreUObjectDelegates::GetPostGarbageCollect();
-    glua_lockcb = LuaLock;
-    glua_unlockcb = LuaUnLock;
+    UScriptStruct* Struct = ((const FStructProperty*)Property)->Struct;
+    if (LuaMath::ToStruct(L, Index, Struct, Value))
+    {
+        return true;
+    }
+    FLuaUEData* SourceData = ToUEData(L, Index);
+    if (!SourceData || SourceData->DataType == EUEDataType::Object || SourceData->GetStruct() != Struct || !SourceData->IsDataValid())
+    {
+        return false;
+    }
+    if (SourceData->GetContainer() != Value)
+    {
+        Struct->CopyScriptStruct(Value, SourceData->GetContainer());
+    }
+    return true;
 }
 
-void FLuaSourceModule::ShutdownModule()
+static int GetPropertyAsText(ULuaState* LuaState, lua_State* L, FLuaUEData* Owner, void* Value, const FProperty* Property)
 {
-	// This function may be called during shutdown to clean up your module.  For modules that support dynamic reloading,
-	// we call this function before unloading the module.
+    FString Text;
+    for (int32 ArrayIndex = 0; ArrayIndex < Property->ArrayDim; ++ArrayIndex)
+    {
+        Property->ExportTextItem_Direct(Text, (uint8*)Value + ArrayIndex * (Property->GetSize() / Property->ArrayDim), nullptr, nullptr, PPF_None);
+    }
+    lua_pushstring(L, TCHAR_TO_UTF8(*Text));
+    return 1;
 }
 
-void* FLuaSourceModule::LuaMalloc(void* ud, void* ptr, size_t osize, size_t nsize)
+FLuaPropertyAccessor FLuaPropertyAccessor::Make(const FProperty* Property)
 {
-    if (nsize == 0)
+    FLuaPropertyAccessor Accessor;
+    Accessor.Property = Property;
+    Accessor.Offset = Property->GetOffset_ForInternal();
+    Accessor.Get = GetPropertyAsText;
+
+    if (Property->ArrayDim != 1)
     {
-#if STATS
-        const uint32 Size = FMemory::GetAllocSize(ptr);
-        
-#endif
-        FMemory::Free(ptr);
-        return nullptr;
+        return Accessor;
     }
 
-    void* Buffer = nullptr;
-    if (!ptr)
+    if (Property->IsA<FIntProperty>())
     {
-        Buffer = FMemory::Malloc(nsize);
-#if STATS
-        const uint32 Size = FMemory::GetAllocSize(Buffer);
-        
-#endif
+        Accessor.Get = GetIntProperty;
+        Accessor.Set = SetIntProperty;
     }
-    else
+    else if (Property->IsA<FFloatProperty>())
     {
-#if STATS
-        const uint32 OldSize = FMemory::GetAllocSize(ptr);
-#endif
-        Buffer = FMemory::Realloc(ptr, nsize);
-#if STATS
-        const uint32 NewSize = FMemory::GetAllocSize(Buffer);
-        if (NewSize > OldSize)
+        Accessor.Get = GetFloatProperty;
+        Accessor.Set = SetFloatProperty;
+    }
+    else if (Property->IsA<FDoubleProperty>())
+    {
+        Accessor.Get = GetDoubleProperty;
+        Accessor.Set = SetDoubleProperty;
+    }
+    else if (Property->IsA<FBoolProperty>())
+    {
+        Accessor.Get = GetBoolProperty;
+        Accessor.Set = SetBoolProperty;
+    }
+    else if (Property->IsA<FByteProperty>())
+    {
+        Accessor.Get = GetByteEnumProperty;
+        Accessor.Set = SetByteEnumProperty;
+    }
+    else if (const FEnumProperty* EnumProperty = CastField<FEnumProperty>(Property))
+    {
+        const bool bByteEnum = EnumProperty->GetUnderlyingProperty()->IsA<FByteProperty>();
+        Accessor.Get = bByteEnum ? GetByteEnumProperty : GetEnumProperty;
+        Accessor.Set = bByteEnum ? SetByteEnumProperty : SetEnumProperty;
+    }
+    else if (const FNumericProperty* NumericProperty = CastField<FNumericProperty>(Property))
+    {
+        if (NumericProperty->IsInteger())
         {
-            
+            Accessor.Get = GetIntegerProperty;
+            Accessor.Set = SetIntegerProperty;
         }
-        else
+    }
+    else if (Property->IsA<FNameProperty>())
+    {
+        Accessor.Get = GetNameProperty;
+        Accessor.Set = SetNameProperty;
+    }
+    else if (Property->IsA<FStrProperty>())
+    {
+        Accessor.Get = GetStrProperty;
+        Accessor.Set = SetStrProperty;
+    }
+    else if (Property->IsA<FObjectProperty>())
+    {
+        Accessor.Get = GetObjectProperty;
+        Accessor.Set = SetObjectProperty;
+    }
+    else if (Property->IsA<FStructProperty>())
+    {
+        Accessor.Get = GetStructProperty;
+        Accessor.Set = SetStructProperty;
+    }
+    return Accessor;
+}
+
+int UEDataIndex(lua_State* L);
+int UEDataNewIndex(lua_State* L);
+int UEDataCallFunction(lua_State* L);
+int OnDestroyUEDataInLua(lua_State* L);
+
+bool ULuaState::IsUEDataMetatable(const Table* Metatable) const
+{
+    return Metatable && Metatable->metatable == UEDataMetatable;
+}
+
+Table* ULuaState::GetTypeMetatable(lua_State* L, const UStruct* Struct)
+{
+    FLuaTypeMetatable& Entry = TypeMetatables.FindOrAdd(Struct);
+    //a stale entry belongs to a destroyed type that happened to have the same address
+    if(Entry.Metatable && Entry.Struct.Get() == Struct)
+    {
+        return Entry.Metatable;
+    }
+
+    //TFieldIterator includes the super types, so the whole inheritance chain ends up in one hash
+    int32 NumFields = 4;
+    for (TFieldIterator<FProperty> It(Struct); It; ++It)
+    {
+        NumFields++;
+    }
+    for (TFieldIterator<UFunction> It(Struct); It; ++It)
+    {
+        NumFields++;
+    }
+
+    lua_getfield(L, LUA_REGISTRYINDEX, UEDataMetatableTableName);//anchors
+    lua_createtable(L, 0, NumFields);//anchors, mt
+    lua_pushcfunction(L, OnDestroyUEDataInLua);
+    lua_setfield(L, -2, "__gc");
+    lua_pushcfunction(L, UEDataIndex);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, UEDataNewIndex);
+    lua_setfield(L, -2, "__newindex");
+    lua_pushstring(L, TCHAR_TO_UTF8(*Struct->GetName()));
+    lua_setfield(L, -2, "__name");
+    for (TFieldIterator<FProperty> It(Struct); It; ++It)
+    {
+        FLuaPropertyAccessor* Accessor = PropertyAccessors.Add_GetRef(MakeUnique<FLuaPropertyAccessor>(FLuaPropertyAccessor::Make(*It))).Get();
+        lua_pushstring(L, TCHAR_TO_UTF8(*It->GetAuthoredName()));
+        lua_pushlightuserdata(L, Accessor);
+        lua_rawset(L, -3);
+    }
+    //functions are closures over their plan, __index hands them out as they are
+    for (TFieldIterator<UFunction> It(Struct); It; ++It)
+    {
+        FLuaFunctionCallPlan* Plan = CallPlans.Add_GetRef(MakeUnique<FLuaFunctionCallPlan>()).Get();
+        Plan->Function = *It;
+        lua_pushstring(L, TCHAR_TO_UTF8(*It->GetName()));//anchors, mt, name
+        lua_pushlightuserdata(L, Plan);
+        lua_pushvalue(L, -2);
+        lua_pushcclosure(L, UEDataCallFunction, 2);//anchors, mt, name, closure
+        lua_rawset(L, -3);
+    }
+    //the shared metatable above every type metatable is what marks a userdata as UE data
+    lua_getfield(L, LUA_REGISTRYINDEX, LuaUEDataMetatableName);//anchors, mt, shared
+    lua_setmetatable(L, -2);//anchors, mt
+    Entry.Struct = Struct;
+    Entry.Metatable = hvalue(s2v(L->top.p - 1));
+    //appended rather than keyed by type, userdata pushed before a reinstance still use the old metatable
+    lua_rawseti(L, -2, luaL_len(L, -2) + 1);//anchors
+    lua_pop(L, 1);
+    return Entry.Metatable;
+}
+
+void ULuaState::ResetTypeMetatables()
+{
+    if(!InnerState)
+    {
+        return;
+    }
+    //accessors and plans stay alive, the old metatables and the userdata using them still point at them
+    lua_lock(InnerState);
+    TypeMetatables.Empty();
+    lua_unlock(InnerState);
+}
+
+//the metamethods can also be fetched with getmetatable and called on anything, so arguments are checked
+FLuaUEData* ToUEData(lua_State* L, int Index)
+{
+    void* UD = nullptr;
+    lua_getallocf(L, &UD);
+    ULuaState* LuaState = (ULuaState*)UD;
+    if (!LuaState || Index > lua_gettop(L))
+    {
+        return nullptr;
+    }
+    const TValue* Obj = s2v(L->ci->func.p + Index);
+    if (!ttisfulluserdata(Obj) || !LuaState->IsUEDataMetatable(uvalue(Obj)->metatable))
+    {
+        return nullptr;
+    }
+    return (FLuaUEData*)getudatamem(uvalue(Obj));
+}
+
+const FLuaPropertyAccessor* ULuaState::ResolvePropertyPath(const UStruct* Struct, const char* Path)
+{
+    TArray<FString> Names;
+    FString(UTF8_TO_TCHAR(Path)).ParseIntoArray(Names, TEXT("."), false);
+    const FProperty* Property = nullptr;
+    int32 Offset = 0;
+    for (const FString& Name : Names)
+    {
+        //only struct members are walked, everything on the path lives inside the owner's memory
+        if (Property)
         {
-            
+            const FStructProperty* StructProperty = CastField<FStructProperty>(Property);
+            if (!StructProperty || StructProperty->ArrayDim != 1)
+            {
+                return nullptr;
+            }
+            Struct = StructProperty->Struct;
+        }
+        Property = nullptr;
+        for (TFieldIterator<FProperty> It(Struct); It; ++It)
+        {
+            if (It->GetAuthoredName() == Name)
+            {
+                Property = *It;
+                break;
+            }
+        }
+        if (!Property)
+        {
+            return nullptr;
+        }
+        Offset += Property->GetOffset_ForInternal();
+    }
+
+    FLuaPropertyAccessor* Accessor = PropertyAccessors.Add_GetRef(MakeUnique<FLuaPropertyAccessor>(FLuaPropertyAccessor::Make(Property))).Get();
+    Accessor->Offset = Offset;
+    return Accessor;
+}
+
+//the field named by the key at 2 in the type metatable of the UE userdata at 1, a dotted property path is resolved
+//on its first use and stored in the metatable under the whole path, later uses cost the same as a plain property
+const TValue* FindUEDataField(lua_State* L, FLuaUEData* UEData)
+{
+    Table* Metatable = uvalue(s2v(L->ci->func.p + 1))->metatable;
+    const TValue* Key = s2v(L->ci->func.p + 2);
+    if(!ttisstring(Key))
+    {
+        return nullptr;
+    }
+    const TValue* Slot = luaH_getstr(Metatable, tsvalue(Key));
+    if(!ttisnil(Slot) || !strchr(getstr(tsvalue(Key)), '.') || !UEData->GetStruct())
+    {
+        return Slot;
+    }
+
+    void* UD = nullptr;
+    lua_getallocf(L, &UD);
+    const FLuaPropertyAccessor* Accessor = ((ULuaState*)UD)->ResolvePropertyPath(UEData->GetStruct(), getstr(tsvalue(Key)));
+    if(!Accessor)
+    {
+        return Slot;
+    }
+    lua_getmetatable(L, 1);//mt
+    lua_pushvalue(L, 2);//mt, path
+    lua_pushlightuserdata(L, (void*)Accessor);//mt, path, accessor
+    lua_rawset(L, -3);//mt
+    lua_pop(L, 1);
+    return luaH_getstr(Metatable, tsvalue(Key));
+}
+
+int UEDataIndex(lua_State* L)
+{
+    lua_settop(L, 2);
+    FLuaUEData* UEData = ToUEData(L, 1);
+    if(!UEData)
+    {
+        return luaL_error(L, "UE data expected");
+    }
+    const TValue* Key = s2v(L->ci->func.p + 2);
+    const TValue* Slot = FindUEDataField(L, UEData);
+    if(!Slot)
+    {
+        return 0;
+    }
+    if(ttisCclosure(Slot))
+    {
+        setobj2s(L, L->top.p, Slot);
+        L->top.p++;
+        return 1;
+    }
+    if(!ttislightuserdata(Slot))
+    {
+        return 0;
+    }
+    if(!UEData->IsDataValid())
+    {
+        return luaL_error(L, "reading %s of an invalid UE object", getstr(tsvalue(Key)));
+    }
+
+    void* UD = nullptr;
+    lua_getallocf(L, &UD);
+    const FLuaPropertyAccessor* Accessor = (const FLuaPropertyAccessor*)pvalue(Slot);
+    return Accessor->Get((ULuaState*)UD, L, UEData, (uint8*)UEData->GetContainer() + Accessor->Offset, Accessor->Property);
+}
+
+int UEDataNewIndex(lua_State* L)
+{
+    lua_settop(L, 3);
+    FLuaUEData* UEData = ToUEData(L, 1);
+    if(!UEData)
+    {
+        return luaL_error(L, "UE data expected");
+    }
+    const TValue* Key = s2v(L->ci->func.p + 2);
+    const TValue* Slot = FindUEDataField(L, UEData);
+    if(!Slot || !ttislightuserdata(Slot))
+    {
+        return luaL_error(L, "no property named %s", ttisstring(Key) ? getstr(tsvalue(Key)) : luaL_typename(L, 2));
+    }
+    const FLuaPropertyAccessor* Accessor = (const FLuaPropertyAccessor*)pvalue(Slot);
+    if(!Accessor->Set)
+    {
+        return luaL_error(L, "property %s can not be set from lua", getstr(tsvalue(Key)));
+    }
+    if(!UEData->IsDataValid())
+    {
+        return luaL_error(L, "writing %s of an invalid UE object", getstr(tsvalue(Key)));
+    }
+    if(!Accessor->Set(L, 3, (uint8*)UEData->GetContainer() + Accessor->Offset, Accessor->Property))
+    {
+        return luaL_error(L, "can not assign a %s to property %s", luaL_typename(L, 3), getstr(tsvalue(Key)));
+    }
+    return 0;
+}
+
+void FLuaFunctionCallPlan::Build()
+{
+    UFunction* Func = Function.Get();
+    check(Func);
+    ParmsSize = Func->ParmsSize;
+    Alignment = FMath::Max(Func->GetMinAlignment(), 1);
+    for (TFieldIterator<FProperty> It(Func); It && It->HasAnyPropertyFlags(CPF_Parm); ++It)
+    {
+        FParam& Param = Params.AddDefaulted_GetRef();
+        Param.Accessor = FLuaPropertyAccessor::Make(*It);
+        Param.bIn = !It->HasAnyPropertyFlags(CPF_ReturnParm) && (!It->HasAnyPropertyFlags(CPF_OutParm) || It->HasAnyPropertyFlags(CPF_ReferenceParm));
+        Param.bOut = It->HasAnyPropertyFlags(CPF_ReturnParm) || (It->HasAnyPropertyFlags(CPF_OutParm) && !It->HasAnyPropertyFlags(CPF_ConstParm));
+        Param.bNeedsInit = !It->HasAnyPropertyFlags(CPF_ZeroConstructor);
+        Param.bNeedsDestroy = !It->HasAnyPropertyFlags(CPF_NoDestructor);
+        bNeedsInit |= Param.bNeedsInit;
+        bNeedsDestroy |= Param.bNeedsDestroy;
+        if (It->HasAnyPropertyFlags(CPF_ReturnParm))
+        {
+            ReturnParam = Params.Num() - 1;
+        }
+    }
+    bBuilt = true;
+}
+
+int PushCallResult(ULuaState* LuaState, lua_State* L, const FLuaFunctionCallPlan::FParam& Param, uint8* Parms)
+{
+    void* Value = Parms + Param.Accessor.Offset;
+    //the frame is gone once the call returns, so structs are copied instead of viewed
+    if (const FStructProperty* StructProperty = CastField<FStructProperty>(Param.Accessor.Property))
+    {
+        if (Param.Accessor.Property->ArrayDim == 1)
+        {
+            if (LuaMath::PushStruct(L, StructProperty->Struct, Value))
+            {
+                return 1;
+            }
+            //onto L, a coroutine calling a UFunction gets its results on its own stack
+            const int Top = lua_gettop(L);
+            LuaState->PushLuaUEData(L, Value, StructProperty->Struct, EUEDataType::Struct, nullptr);
+            if (lua_gettop(L) == Top)
+            {
+                lua_pushnil(L);
+            }
+            return 1;
+        }
+    }
+    return Param.Accessor.Get(LuaState, L, nullptr, Value, Param.Accessor.Property);
+}
+
+/** What UEDataCallFunction hands to CallUFunction through lua_pcall */
+struct FUFunctionCall
+{
+    ULuaState* LuaState;
+    const FLuaFunctionCallPlan* Plan;
+    UObject* Object;
+    UFunction* Function;
+    const char* FunctionName;
+    uint8* Parms;
+};
+
+//the FUFunctionCall, then the arguments of UEDataCallFunction, run protected so the frame is released whatever it raises
+static int CallUFunction(lua_State* L)
+{
+    const FUFunctionCall* Call = (const FUFunctionCall*)lua_touserdata(L, 1);
+    const FLuaFunctionCallPlan* Plan = Call->Plan;
+    uint8* Parms = Call->Parms;
+
+    int Argument = 3;
+    for (const FLuaFunctionCallPlan::FParam& Param : Plan->Params)
+    {
+        if (!Param.bIn)
+        {
+            continue;
+        }
+        //missing trailing arguments keep their zero value
+        if (!lua_isnone(L, Argument) && !(Param.Accessor.Set && Param.Accessor.Set(L, Argument, Parms + Param.Accessor.Offset, Param.Accessor.Property)))
+        {
+            return luaL_error(L, "bad argument #%d to %s (got %s)", Argument - 1, Call->FunctionName, luaL_typename(L, Argument));
+        }
+        Argument++;
+    }
+
+    Call->Object->ProcessEvent(Call->Function, Parms);
+    //one slot per result, plus one for the metatable a UEMath push looks up
+    if (!lua_checkstack(L, Plan->Params.Num() + 1))
+    {
+        return luaL_error(L, "no stack space for the results of %s", Call->FunctionName);
+    }
+    int NumResults = 0;
+    if (Plan->ReturnParam != INDEX_NONE)
+    {
+        NumResults += PushCallResult(Call->LuaState, L, Plan->Params[Plan->ReturnParam], Parms);
+    }
+    for (int32 ParamIndex = 0; ParamIndex < Plan->Params.Num(); ++ParamIndex)
+    {
+        if (Plan->Params[ParamIndex].bOut && ParamIndex != Plan->ReturnParam)
+        {
+            NumResults += PushCallResult(Call->LuaState, L, Plan->Params[ParamIndex], Parms);
+        }
+    }
+    return NumResults;
+}
+
+//upvalues: the FLuaFunctionCallPlan and the function name, called as obj:Function(...)
+int UEDataCallFunction(lua_State* L)
+{
+    SCOPE_CYCLE_COUNTER(STAT_LuaCallUFunction);
+    FLuaFunctionCallPlan* Plan = (FLuaFunctionCallPlan*)lua_touserdata(L, lua_upvalueindex(1));
+    const char* FunctionName = lua_tostring(L, lua_upvalueindex(2));
+    FLuaUEData* UEData = ToUEData(L, 1);
+    if(!UEData || UEData->DataType != EUEDataType::Object)
+    {
+        return luaL_error(L, "calling %s needs a UObject, use obj:%s()", FunctionName, FunctionName);
+    }
+    UFunction* Function = Plan->Function.Get();
+    if(!Function || !UEData->IsDataValid())
+    {
+        return luaL_error(L, "calling %s on an invalid UE object", FunctionName);
+    }
+    if(!Plan->bBuilt)
+    {
+        Plan->Build();
+    }
+
+    void* UD = nullptr;
+    lua_getallocf(L, &UD);
+    ULuaState* LuaState = (ULuaState*)UD;
+    UObject* Object = Function->HasAnyFunctionFlags(FUNC_Static) ? Function->GetOuterUClass()->GetDefaultObject() : UEData->Data.Object.Object;
+    //the plan can be taken off one class and called with any object, ProcessEvent would run it on the wrong layout
+    if(!Object->IsA(Function->GetOuterUClass()))
+    {
+        luaL_where(L, 1);
+        lua_pushfstring(L, "calling %s on a %s, expected a %s", FunctionName, TCHAR_TO_UTF8(*Object->GetClass()->GetName()), TCHAR_TO_UTF8(*Function->GetOuterUClass()->GetName()));
+        lua_concat(L, 2);
+        return lua_error(L); // raised here, where no C++ local is left to skip
+    }
+    if(!lua_checkstack(L, 2))
+    {
+        return luaL_error(L, "no stack space to call %s", FunctionName);
+    }
+
+    //nested calls from inside ProcessEvent push their frames on top of this one
+    const FLuaCallFrameStack::FMark Mark = LuaState->CallFrames.GetMark();
+    uint8* Parms = (uint8*)LuaState->CallFrames.Push(Plan->ParmsSize, Plan->Alignment);
+    FMemory::Memzero(Parms, Plan->ParmsSize);
+    if(Plan->bNeedsInit)
+    {
+        for (const FLuaFunctionCallPlan::FParam& Param : Plan->Params)
+        {
+            if (Param.bNeedsInit)
+            {
+                Param.Accessor.Property->InitializeValue_InContainer(Parms);
+            }
+        }
+    }
+
+    //setting an argument or pushing a result can raise a memory error, the frame below must still be released
+    FUFunctionCall Call{ LuaState, Plan, Object, Function, FunctionName, Parms };
+    const int NumArgs = lua_gettop(L);
+    lua_pushcfunction(L, CallUFunction);
+    lua_insert(L, 1);
+    lua_pushlightuserdata(L, &Call);
+    lua_insert(L, 2);//CallUFunction, call, args
+    const int Status = lua_pcall(L, NumArgs + 1, LUA_MULTRET, 0);
+
+    if(Plan->bNeedsDestroy)
+    {
+        for (const FLuaFunctionCallPlan::FParam& Param : Plan->Params)
+        {
+            if (Param.bNeedsDestroy)
+            {
+                Param.Accessor.Property->DestroyValue_InContainer(Parms);
+            }
+        }
+    }
+    LuaState->CallFrames.Pop(Mark);
+
+    if(Status != LUA_OK)
+    {
+        return lua_error(L); // raised here, where no C++ local is left to skip
+    }
+    return lua_gettop(L);
+}
+
+int OnDestroyUEDataInLua(lua_State* L)
+{
+    SCOPE_CYCLE_COUNTER(STAT_LuaDestroyUEData);
+    void* UD = nullptr;
+    lua_getallocf(L, &UD);
+    ULuaState* LuaState = (ULuaState*)UD;
+
+    const TValue* Obj = s2v(L->ci->func.p + 1);
+    if(ensure(LuaState && ttisfulluserdata(Obj) && LuaState->IsUEDataMetatable(uvalue(Obj)->metatable)))
+    {
+        FLuaUEData* LuaUEData = (FLuaUEData*)getudatamem(uvalue(Obj));
+        LuaState->UnregisterUEData(LuaUEData);
+        LuaUEData->~FLuaUEData();
+    }
+    return 0;
+}
+
+static ULuaStatePool* GetJobPool(lua_State* L)
+{
+    void* UD = nullptr;
+    lua_getallocf(L, &UD);
+    return UD ? ((ULuaState*)UD)->JobPool.Get() : nullptr;
+}
+
+//leaves the job id or an error message on the stack, the caller raises the error once nothing with a destructor is alive
+static bool DispatchLuaJob(lua_State* L)
+{
+    const char* ModuleName = luaL_checkstring(L, 1);
+    const char* FunctionName = luaL_checkstring(L, 2);
+    ULuaStatePool* Pool = GetJobPool(L);
+    if(!Pool || Pool->GetNumWorkers() == 0)
+    {
+        lua_pushstring(L, "no running job pool is set for this lua state");
+        return false;
+    }
+
+    TArray<uint8> Args;
+    FString Error;
+    if(!LuaJobSerializer::Write(L, 3, Args, Error))
+    {
+        lua_pushstring(L, TCHAR_TO_UTF8(*Error));
+        return false;
+    }
+    lua_pushinteger(L, Pool->Dispatch(UTF8_TO_TCHAR(ModuleName), UTF8_TO_TCHAR(FunctionName), MoveTemp(Args)));
+    return true;
+}
+
+//LuaJobs.Dispatch(ModuleName, FunctionName, ...) -> JobId
+static int LuaJobsDispatch(lua_State* L)
+{
+    if(!DispatchLuaJob(L))
+    {
+        return lua_error(L);
+    }
+    return 1;
+}
+
+//LuaJobs.Poll(JobId) -> false while pending, otherwise true, bSuccess, results... or the error message
+static int LuaJobsPoll(lua_State* L)
+{
+    const int64 JobId = luaL_checkinteger(L, 1);
+    ULuaStatePool* Pool = GetJobPool(L);
+    FLuaStatePoolResult Result;
+    if(!Pool || !Pool->Poll(JobId, Result))
+    {
+        lua_pushboolean(L, false);
+        return 1;
+    }
+    lua_pushboolean(L, true);
+    lua_pushboolean(L, Result.bSuccess);
+    return 2 + FMath::Max(LuaJobSerializer::Read(L, Result.Data), 0);
+}
+
+void LuaLock(lua_State* L);
+void LuaUnLock(lua_State* L);
+
+//everything Init sets up after lua_newstate, the memory limit already applies to it
+int OpenStateLibs(lua_State* L)
+{
+    void* UD = nullptr;
+    lua_getallocf(L, &UD);
+    ULuaState* LuaState = (ULuaState*)UD;
+
+    luaL_openlibs(L);
+
+    RegisterCustomLoader(L, true);
+
+    lua_newtable(L);//TurinmaTable
+    lua_newtable(L);//TurinmaTable, metatable
+    //lua_pushcfunction(L,)
+
+
+    //lua_setglobal(L, );
+
+    lua_getglobal(L, "require");
+    lua_pushstring(L, "TurinmaLua.Core.Init");
+
+    
+    lua_pcall(L, 1, LUA_MULTRET,0);
+    lua_pop(L, lua_gettop(L));
+
+    RegisterCustomLoader(L, false);
+
+    AddUsefulLuaTableWithMetatableToTable(L, ULuaState::UObjectExtensionWeakTableName, LUA_REGISTRYINDEX, true);
+    AddUsefulLuaTableWithMetatableToTable(L, ULuaState::UObjectExtensionStrongTableName, LUA_REGISTRYINDEX, false);
+    AddUsefulLuaTableWithMetatableToTable(L, ULuaState::UObjectCacheTableName, LUA_REGISTRYINDEX, true);
+    lua_getfield(L, LUA_REGISTRYINDEX, ULuaState::UObjectCacheTableName);
+    LuaState->UObjectCache = hvalue(s2v(L->top.p - 1));
+
+    lua_newtable(L);
+    lua_setfield(L, LUA_REGISTRYINDEX, ULuaState::UEDataMetatableTableName);
+
+    lua_pop(L, lua_gettop(L));
+
+    //metatable of the per type metatables, userdata never use it directly
+    luaL_newmetatable(L, ULuaState::LuaUEDataMetatableName); // LuaUEDataMetatableName
+
+    LuaState->UEDataMetatable = hvalue(s2v(L->top.p - 1));
+
+    //todo finalize LuaUEDataMetatableName
+    lua_pop(L, 1);
+
+    lua_newtable(L);//LuaJobs
+    lua_pushcfunction(L, LuaJobsDispatch);
+    lua_setfield(L, -2, "Dispatch");
+    lua_pushcfunction(L, LuaJobsPoll);
+    lua_setfield(L, -2, "Poll");
+    lua_setglobal(L, "LuaJobs");
+
+    LuaMath::Register(L);
+    return 0;
+}
+
+void ULuaState::Init()
+{
+    OwnerThreadId = GetLocalThreadId();
+    if(bUsePooledAllocator)
+    {
+        Allocator = MakeUnique<FLuaStateAllocator>();
+    }
+    InnerState = lua_newstate(&FLuaSourceModule::LuaMalloc, this);
+    if(!InnerState)
+    {
+        UE_LOG(LogTemp, Error, TEXT("LuaState %s: can not create the lua state"), *GetName());
+        Allocator.Reset();
+        return;
+    }
+#if DO_CHECK
+    lua_setlockf(InnerState, LuaLock, LuaUnLock, this);
+#else
+    //a single thread state has nothing to check once asserts are compiled out
+    if(ThreadingMode != ELuaThreadingMode::SingleThread)
+    {
+        lua_setlockf(InnerState, LuaLock, LuaUnLock, this);
+    }
+#endif
+    //the collector only runs from StepGC, PostGarbageCollect or under allocation pressure
+    lua_gc(InnerState, GCMode == ELuaGCMode::Generational ? LUA_GCGEN : LUA_GCINC, 0, 0);
+    lua_gc(InnerState, LUA_GCSTOP);
+    bTickGC = IsInGameThread();
+
+    lua_pushcfunction(InnerState, OpenStateLibs);
+    if(lua_pcall(InnerState, 0, 0, 0) != LUA_OK)
+    {
+        UE_LOG(LogTemp, Error, TEXT("LuaState %s: %s"), *GetName(), lua_isstring(InnerState, -1) ? UTF8_TO_TCHAR(lua_tostring(InnerState, -1)) : TEXT("can not open the libraries"));
+        Finalize();
+        return;
+    }
+    
+    FCoreUObjectDelegates::GetPostGarbageCollect().AddUObject(this, &ULuaState::PostGarbageCollect);
+#if WITH_EDITOR
+    //blueprint compiles, hot reload and live coding can all change the layout of a type that already has a metatable
+    FCoreUObjectDelegates::OnObjectsReinstanced.AddWeakLambda(this, [this](const FCoreUObjectDelegates::FReplacementObjectMap&) { ResetTypeMetatables(); });
+    FCoreUObjectDelegates::ReloadCompleteDelegate.AddWeakLambda(this, [this](EReloadCompleteReason) { ResetTypeMetatables(); });
+#endif
+
+
+    LuaCPPAPI::luaC_foreachgcobj(InnerState, OnTravelLuaGCObject);
+}
+
+void ULuaState::Finalize()
+{
+    if(InnerState)
+    {
+        FCoreUObjectDelegates::GetPostGarbageCollect().RemoveAll(this);
+#if WITH_EDITOR
+        FCoreUObjectDelegates::OnObjectsReinstanced.RemoveAll(this);
+        FCoreUObjectDelegates::ReloadCompleteDelegate.RemoveAll(this);
+#endif
+        {
+            //every remaining UE userdata is finalized here, their slots go back in one push
+            FCustomMemoryUnsignBatch UnsignBatch;
+            lua_close(InnerState);
+        }
+        InnerState = nullptr;
+        Allocator.Reset();
+        if(ThreadingMode != ELuaThreadingMode::SingleThread && EnterCount > 0)
+        {
+            //lua_close enters the core and never leaves it
+            EnterCount = 0;
+            LockedThreadId.store(0xffffffffffffffff, std::memory_order_relaxed);
+            LuaMutex.Unlock();
+        }
+        if(ThreadingMode == ELuaThreadingMode::DebugContention)
+        {
+            UE_LOG(LogTemp, Log, TEXT("LuaState %s: %llu contended lua_lock, %.3f ms waited"), *GetName(),
+                ContendedLockNum.load(), FPlatformTime::ToMilliseconds64(ContendedLockCycles.load()));
+        }
+        UEDataMetatable = nullptr;
+        UObjectCache = nullptr;
+        LiveUEData.Empty();
+        TypeMetatables.Empty();
+        PropertyAccessors.Empty();
+        CallPlans.Empty();
+        DEC_MEMORY_STAT_BY(STAT_LuaHeapSize, ReportedHeapBytes);
+        ReportedHeapBytes = 0;
+        AllocatedSinceGCStep = 0;
+        bGCPressure = false;
+        bGCRunning = false;
+    }
+}
+
+void ULuaState::Pop(int32 Num)
+{
+    if (InnerState)
+    {
+        int32 MaxPop = lua_gettop(InnerState);
+        int32 P = FMath::Min(Num, MaxPop);
+        if(P > 0)
+        {
+            lua_pop(InnerState, P);
+        }
+    }
+}
+
+void ULuaState::AddReferencedObjects(UObject* InThis, FReferenceCollector& Collector)
+{
+    ULuaState* This = CastChecked<ULuaState>(InThis);
+
+    if(This->InnerState && CVarLuaUseUEDataRegistry.GetValueOnAnyThread())
+    {
+        SCOPE_CYCLE_COUNTER(STAT_LuaCollectUERefs);
+        SET_DWORD_STAT(STAT_LuaLiveUEData, This->LiveUEData.Num());
+
+        lua_lock(This->InnerState);
+        for (const FLuaUEDataRegistryEntry& Entry : This->LiveUEData)
+        {
+            Entry.UEData->AddReferencedObjects(This, Collector, Entry.bStrong);
+        }
+        lua_unlock(This->InnerState);
+    }
+    else if(This->InnerState)
+    {
+        SCOPE_CYCLE_COUNTER(STAT_LuaCollectUERefs);
+        LuaCPPAPI::luaC_foreachgcobj(This->InnerState, This->HeapWalkContext, [This, &Collector](GCObject* o, bool w, lua_State* l)->void
+            {
+                This->OnCollectLuaRefs(Collector, o, w, l);
+            }, true);
+    }
+}
+
+void LuaLock(lua_State* L)
+{
+    ULuaState* LuaState = (ULuaState*)(G(L)->ud_lock);
+    LuaState->LockLua();
+}
+
+void LuaUnLock(lua_State* L)
+{
+    ULuaState* LuaState = (ULuaState*)(G(L)->ud_lock);
+    LuaState->UnlockLua();
+}
+
+#if WITH_EDITOR
+void FLuaSourceModule::WatchContentPath(const FString& AssetPath, const FString& FilesystemPath)
+{
+    FLuaModuleResolveCache::Get().Reset();
+    const FString Directory = FPaths::ConvertRelativePathToFull(FilesystemPath);
+    if (WatchedDirectories.Contains(Directory) || !IFileManager::Get().DirectoryExists(*Directory))
+    {
+        return;
+    }
+
+    IDirectoryWatcher* DirectoryWatcher = FModuleManager::LoadModuleChecked<FDirectoryWatcherModule>(TEXT("DirectoryWatcher")).Get();
+    FDelegateHandle Handle;
+    DirectoryWatcher->RegisterDirectoryChangedCallback_Handle(Directory, IDirectoryWatcher::FDirectoryChanged::CreateLambda([](const TArray<FFileChangeData>& Changes)
+        {
+            for (const FFileChangeData& Change : Changes)
+            {
+                //edits only change the content, which the bytecode cache already checks
+                if (Change.Action != FFileChangeData::FCA_Modified && FPaths::GetExtension(Change.Filename) == TEXT("lua"))
+                {
+                    FLuaModuleResolveCache::Get().Reset();
+                    return;
+                }
+            }
+        }), Handle);
+    WatchedDirectories.Add(Directory, Handle);
+}
+
+void FLuaSourceModule::UnwatchContentPath(const FString& AssetPath, const FString& FilesystemPath)
+{
+    FLuaModuleResolveCache::Get().Reset();
+    FDelegateHandle Handle;
+    if (WatchedDirectories.RemoveAndCopyValue(FPaths::ConvertRelativePathToFull(FilesystemPath), Handle))
+    {
+        if (FDirectoryWatcherModule* DirectoryWatcherModule = FModuleManager::GetModulePtr<FDirectoryWatcherModule>(TEXT("DirectoryWatcher")))
+        {
+            DirectoryWatcherModule->Get()->UnregisterDirectoryChangedCallback_Handle(FPaths::ConvertRelativePathToFull(FilesystemPath), Handle);
+        }
+    }
+}
+#endif
+
+void FLuaSourceModule::StartupModule()
+{
+	// This code will execute after your module is loaded into memory; the exact timing is specified in the .uplugin file per-module
+    //FCoreUObjectDelegates::GetPostGarbageCollect();
+#if WITH_EDITOR
+    TArray<FString> RootPaths;
+    FPackageName::QueryRootContentPaths(RootPaths);
+    for (const FString& RootPath : RootPaths)
+    {
+        WatchContentPath(RootPath, FPackageName::LongPackageNameToFilename(RootPath));
+    }
+    FPackageName::OnContentPathMounted().AddRaw(this, &FLuaSourceModule::WatchContentPath);
+    FPackageName::OnContentPathDismounted().AddRaw(this, &FLuaSourceModule::UnwatchContentPath);
+
+    if (IsRunningCookCommandlet())
+    {
+        //every plugin content path is mounted by then, the bundle is staged from Content/LuaBundle
+        FCoreDelegates::OnPostEngineInit.AddLambda([]()
+            {
+                FLuaScriptBundle::Build(FLuaScriptBundle::GetDefaultPath(), false);
+            });
+    }
+#else
+    ScriptBundle = FLuaScriptBundle::Load(FLuaScriptBundle::GetDefaultPath());
+#endif
+}
+
+void FLuaSourceModule::ShutdownModule()
+{
+	// This function may be called during shutdown to clean up your module.  For modules that support dynamic reloading,
+	// we call this function before unloading the module.
+#if WITH_EDITOR
+    FPackageName::OnContentPathMounted().RemoveAll(this);
+    FPackageName::OnContentPathDismounted().RemoveAll(this);
+    if (FDirectoryWatcherModule* DirectoryWatcherModule = FModuleManager::GetModulePtr<FDirectoryWatcherModule>(TEXT("DirectoryWatcher")))
+    {
+        for (const TPair<FString, FDelegateHandle>& Watched : WatchedDirectories)
+        {
+            DirectoryWatcherModule->Get()->UnregisterDirectoryChangedCallback_Handle(Watched.Key, Watched.Value);
         }
+    }
+    WatchedDirectories.Empty();
 #endif
+    ScriptBundle.Reset();
+}
+
+void* FLuaSourceModule::LuaMalloc(void* ud, void* ptr, size_t osize, size_t nsize)
+{
+    //when ptr is null osize is the type of the new object, not a size
+    const size_t OldSize = ptr ? osize : 0;
+    //pool workers allocate without an owning ULuaState
+    ULuaState* LuaState = (ULuaState*)ud;
+    if (LuaState && nsize > OldSize)
+    {
+        if (!LuaState->CanAllocate(nsize - OldSize))
+        {
+            //lua runs an emergency collection and retries once before raising a memory error
+            return nullptr;
+        }
+    }
+
+    void* Buffer = nullptr;
+    if (LuaState && LuaState->Allocator)
+    {
+        Buffer = LuaState->Allocator->Realloc(ptr, OldSize, nsize);
+    }
+    else if (nsize == 0)
+    {
+        FMemory::Free(ptr);
+    }
+    else
+    {
+        Buffer = FMemory::Realloc(ptr, nsize);
+    }
+
+    if (LuaState && (Buffer || nsize == 0))
+    {
+        //only this state's allocations write it, and those are serialized by lua_lock
+        LuaState->AllocatedBytes.store(LuaState->AllocatedBytes.load(std::memory_order_relaxed) + nsize - OldSize, std::memory_order_relaxed);
+        //a failed allocation adds no gc pressure, lua's emergency collection already deals with it
+        if (Buffer && nsize > OldSize)
+        {
+            LuaState->OnLuaAllocated(nsize - OldSize);
+        }
     }
     return Buffer;
 }
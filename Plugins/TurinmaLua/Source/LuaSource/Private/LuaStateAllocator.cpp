@@ -0,0 +1,136 @@
+// Copyright Epic Games, Inc. All Rights Reserved.
+
+#include "LuaStateAllocator.h"
+#include "LuaSource.h"
+#include "Stats/Stats.h"
+
+DECLARE_MEMORY_STAT(TEXT("Lua Allocator Pages"), STAT_LuaAllocatorPages, STATGROUP_TurinmaLua);
+
+FLuaStateAllocator::~FLuaStateAllocator()
+{
+    for (void* Page : Pages)
+    {
+        FMemory::Free(Page);
+    }
+    DEC_MEMORY_STAT_BY(STAT_LuaAllocatorPages, GetPageBytes());
+}
+
+void* FLuaStateAllocator::AllocateSmall(int32 ClassIndex)
+{
+    FSizeClass& Class = Classes[ClassIndex];
+    const SIZE_T BlockSize = (ClassIndex + 1) * Granularity;
+    SmallUsedBytes += BlockSize;
+    if (FFreeBlock* Block = Class.FreeList)
+    {
+        Class.FreeList = Block->Next;
+        return Block;
+    }
+    if (Class.Cursor + BlockSize > Class.End)
+    {
+        Class.Cursor = (uint8*)FMemory::Malloc(PageSize, Granularity);
+        Class.End = Class.Cursor + PageSize;
+        Pages.Add(Class.Cursor);
+        INC_MEMORY_STAT_BY(STAT_LuaAllocatorPages, PageSize);
+    }
+    void* Block = Class.Cursor;
+    Class.Cursor += BlockSize;
+    return Block;
+}
+
+void FLuaStateAllocator::FreeSmall(void* Ptr, int32 ClassIndex)
+{
+    FSizeClass& Class = Classes[ClassIndex];
+    FFreeBlock* Block = (FFreeBlock*)Ptr;
+    Block->Next = Class.FreeList;
+    Class.FreeList = Block;
+    SmallUsedBytes -= (ClassIndex + 1) * Granularity;
+}
+
+void* FLuaStateAllocator::Realloc(void* Ptr, SIZE_T OldSize, SIZE_T NewSize)
+{
+    const bool bOldSmall = Ptr && OldSize <= MaxSmallSize;
+    if (NewSize == 0)
+    {
+        if (bOldSmall)
+        {
+            FreeSmall(Ptr, GetClassIndex(OldSize));
+        }
+        else
+        {
+            FMemory::Free(Ptr);
+        }
+        return nullptr;
+    }
+
+    if (NewSize > MaxSmallSize)
+    {
+        if (Ptr && !bOldSmall)
+        {
+            return FMemory::Realloc(Ptr, NewSize, Granularity);
+        }
+        void* Block = FMemory::Malloc(NewSize, Granularity);
+        if (Block && Ptr)
+        {
+            FMemory::Memcpy(Block, Ptr, OldSize);
+            FreeSmall(Ptr, GetClassIndex(OldSize));
+        }
+        return Block;
+    }
+
+    const int32 NewClassIndex = GetClassIndex(NewSize);
+    if (bOldSmall && GetClassIndex(OldSize) == NewClassIndex)
+    {
+        return Ptr;
+    }
+    void* Block = AllocateSmall(NewClassIndex);
+    if (Ptr)
+    {
+        FMemory::Memcpy(Block, Ptr, FMath::Min(OldSize, NewSize));
+        if (bOldSmall)
+        {
+            FreeSmall(Ptr, GetClassIndex(OldSize));
+        }
+        else
+        {
+            FMemory::Free(Ptr);
+        }
+    }
+    return Block;
+}
+
+FLuaCallFrameStack::~FLuaCallFrameStack()
+{
+    for (const FBlock& Block : Blocks)
+    {
+        FMemory::Free(Block.Data);
+    }
+}
+
+void* FLuaCallFrameStack::Push(SIZE_T Size, SIZE_T Alignment)
+{
+    check(Alignment <= BlockAlignment);
+    if (Current != INDEX_NONE)
+    {
+        const SIZE_T Offset = Align(Used, Alignment);
+        if (Offset + Size <= Blocks[Current].Size)
+        {
+            Used = Offset + Size;
+            return Blocks[Current].Data + Offset;
+        }
+    }
+
+    ++Current;
+    if (Current == Blocks.Num())
+    {
+        Blocks.Add(FBlock{ nullptr, 0 });
+    }
+    FBlock& Block = Blocks[Current];
+    if (Block.Size < Size)
+    {
+        FMemory::Free(Block.Data);
+        Block.Size = FMath::Max(BlockSize, Size);
+        Block.Data = (uint8*)FMemory::Malloc(Block.Size, BlockAlignment);
+    }
+    Used = Size;
+    return Block.Data;
+}
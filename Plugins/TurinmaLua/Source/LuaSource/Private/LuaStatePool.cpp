@@ -0,0 +1,467 @@
+// Copyright Epic Games, Inc. All Rights Reserved.
+
+#include "LuaStatePool.h"
+#include "LuaSource.h"
+#include "HAL/Runnable.h"
+#include "HAL/RunnableThread.h"
+#include "HAL/Event.h"
+#include "HAL/PlatformProcess.h"
+#include "Containers/Queue.h"
+#include "Misc/ScopeLock.h"
+#include "Stats/Stats.h"
+
+DECLARE_CYCLE_STAT(TEXT("Lua Pool Job"), STAT_LuaPoolJob, STATGROUP_TurinmaLua);
+DECLARE_DWORD_ACCUMULATOR_STAT(TEXT("Lua Pool Jobs Dispatched"), STAT_LuaPoolJobsDispatched, STATGROUP_TurinmaLua);
+DECLARE_DWORD_ACCUMULATOR_STAT(TEXT("Lua Pool Jobs Failed"), STAT_LuaPoolJobsFailed, STATGROUP_TurinmaLua);
+
+void RegisterCustomLoader(lua_State* L, bool bDefualt);
+
+namespace LuaJobSerializer
+{
+    enum class EValueTag : uint8
+    {
+        Nil,
+        False,
+        True,
+        Integer,
+        Number,
+        String,
+        Table,
+        TableEnd,
+    };
+
+    //also bounds recursive tables, which can not be serialized
+    static constexpr int32 MaxDepth = 32;
+
+    template<typename T>
+    static void WriteRaw(TArray<uint8>& Out, const T& Value)
+    {
+        Out.Append((const uint8*)&Value, sizeof(T));
+    }
+
+    static bool WriteValue(lua_State* L, int32 Index, TArray<uint8>& Out, FString& OutError, int32 Depth)
+    {
+        switch (lua_type(L, Index))
+        {
+        case LUA_TNIL:
+            Out.Add((uint8)EValueTag::Nil);
+            return true;
+        case LUA_TBOOLEAN:
+            Out.Add((uint8)(lua_toboolean(L, Index) ? EValueTag::True : EValueTag::False));
+            return true;
+        case LUA_TNUMBER:
+            if (lua_isinteger(L, Index))
+            {
+                Out.Add((uint8)EValueTag::Integer);
+                WriteRaw(Out, lua_tointeger(L, Index));
+            }
+            else
+            {
+                Out.Add((uint8)EValueTag::Number);
+                WriteRaw(Out, lua_tonumber(L, Index));
+            }
+            return true;
+        case LUA_TSTRING:
+        {
+            size_t Len = 0;
+            const char* Str = lua_tolstring(L, Index, &Len);
+            Out.Add((uint8)EValueTag::String);
+            WriteRaw(Out, (uint32)Len);
+            Out.Append((const uint8*)Str, (int32)Len);
+            return true;
+        }
+        case LUA_TTABLE:
+        {
+            if (Depth >= MaxDepth)
+            {
+                OutError = TEXT("table is recursive or nested too deep");
+                return false;
+            }
+            if (!lua_checkstack(L, 2))
+            {
+                OutError = TEXT("lua stack overflow");
+                return false;
+            }
+            Index = lua_absindex(L, Index);
+            Out.Add((uint8)EValueTag::Table);
+            lua_pushnil(L);
+            while (lua_next(L, Index))
+            {
+                //key, value
+                if (!WriteValue(L, -2, Out, OutError, Depth + 1) || !WriteValue(L, -1, Out, OutError, Depth + 1))
+                {
+                    lua_pop(L, 2);
+                    return false;
+                }
+                lua_pop(L, 1);
+            }
+            Out.Add((uint8)EValueTag::TableEnd);
+            return true;
+        }
+        default:
+            OutError = FString::Printf(TEXT("a %s can not be passed between lua states"), UTF8_TO_TCHAR(luaL_typename(L, Index)));
+            return false;
+        }
+    }
+
+    struct FReader
+    {
+        const TArray<uint8>& Data;
+        int32 Offset = 0;
+
+        bool ReadBytes(void* Dest, int32 Num)
+        {
+            if (Num < 0 || Offset + Num > Data.Num())
+            {
+                return false;
+            }
+            FMemory::Memcpy(Dest, Data.GetData() + Offset, Num);
+            Offset += Num;
+            return true;
+        }
+    };
+
+    static bool ReadValue(lua_State* L, FReader& Reader, int32 Depth)
+    {
+        uint8 Tag = 0;
+        if (Depth > MaxDepth || !lua_checkstack(L, 3) || !Reader.ReadBytes(&Tag, 1))
+        {
+            return false;
+        }
+        switch ((EValueTag)Tag)
+        {
+        case EValueTag::Nil:
+            lua_pushnil(L);
+            return true;
+        case EValueTag::False:
+        case EValueTag::True:
+            lua_pushboolean(L, (EValueTag)Tag == EValueTag::True);
+            return true;
+        case EValueTag::Integer:
+        {
+            lua_Integer Value = 0;
+            if (!Reader.ReadBytes(&Value, sizeof(Value)))
+            {
+                return false;
+            }
+            lua_pushinteger(L, Value);
+            return true;
+        }
+        case EValueTag::Number:
+        {
+            lua_Number Value = 0;
+            if (!Reader.ReadBytes(&Value, sizeof(Value)))
+            {
+                return false;
+            }
+            lua_pushnumber(L, Value);
+            return true;
+        }
+        case EValueTag::String:
+        {
+            uint32 Len = 0;
+            if (!Reader.ReadBytes(&Len, sizeof(Len)) || (int64)Reader.Offset + Len > Reader.Data.Num())
+            {
+                return false;
+            }
+            lua_pushlstring(L, (const char*)Reader.Data.GetData() + Reader.Offset, Len);
+            Reader.Offset += Len;
+            return true;
+        }
+        case EValueTag::Table:
+            lua_newtable(L);
+            while (Reader.Offset < Reader.Data.Num())
+            {
+                if ((EValueTag)Reader.Data[Reader.Offset] == EValueTag::TableEnd)
+                {
+                    Reader.Offset++;
+                    return true;
+                }
+                //table, key, value
+                if (!ReadValue(L, Reader, Depth + 1) || lua_isnil(L, -1) || !ReadValue(L, Reader, Depth + 1))
+                {
+                    return false;
+                }
+                lua_rawset(L, -3);
+            }
+            return false;
+        default:
+            return false;
+        }
+    }
+
+    bool Write(lua_State* L, int32 FirstIndex, TArray<uint8>& Out, FString& OutError)
+    {
+        const int32 Top = lua_gettop(L);
+        for (int32 Index = FirstIndex; Index <= Top; ++Index)
+        {
+            if (!WriteValue(L, Index, Out, OutError, 0))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    //a failed job may have no usable lua state left, so its message is encoded without one
+    static void WriteError(const FString& Error, TArray<uint8>& Out)
+    {
+        FTCHARToUTF8 Utf8Error(*Error);
+        Out.Add((uint8)EValueTag::String);
+        WriteRaw(Out, (uint32)Utf8Error.Length());
+        Out.Append((const uint8*)Utf8Error.Get(), Utf8Error.Length());
+    }
+
+    int32 Read(lua_State* L, const TArray<uint8>& Data)
+    {
+        const int32 Top = lua_gettop(L);
+        FReader Reader{ Data };
+        int32 Num = 0;
+        while (Reader.Offset < Data.Num())
+        {
+            if (!ReadValue(L, Reader, 0))
+            {
+                lua_settop(L, Top);
+                return INDEX_NONE;
+            }
+            Num++;
+        }
+        return Num;
+    }
+}
+
+struct FLuaStatePoolJob
+{
+    int64 JobId = INDEX_NONE;
+    FString ModuleName;
+    FString FunctionName;
+    TArray<uint8> Args;
+};
+
+class FLuaStatePoolWorker : public FRunnable
+{
+    ULuaStatePool* Pool;
+    TQueue<FLuaStatePoolJob, EQueueMode::Mpsc> Jobs;
+    FEvent* WakeEvent;
+    FRunnableThread* Thread;
+    std::atomic<bool> bStopping = false;
+    std::atomic<int32> PendingNum = 0;
+
+    struct FJobCall
+    {
+        const char* ModuleName;
+        const char* FunctionName;
+        const TArray<uint8>* Args;
+    };
+
+    //runs under lua_pcall with the FJobCall as light userdata, anything raised here, out of memory included,
+    //only fails the job. Nothing with a destructor lives in this frame, the strings were converted by the caller
+    static int CallJob(lua_State* L)
+    {
+        const FJobCall* Call = (const FJobCall*)lua_touserdata(L, 1);
+        lua_settop(L, 0);
+        lua_getglobal(L, "require");
+        lua_pushstring(L, Call->ModuleName);
+        lua_call(L, 1, 1);
+        if (!lua_istable(L, 1))
+        {
+            return luaL_error(L, "module %s is not a table", Call->ModuleName);
+        }
+        //module, function, args...
+        lua_getfield(L, 1, Call->FunctionName);
+        const int32 NumArgs = LuaJobSerializer::Read(L, *Call->Args);
+        if (NumArgs == INDEX_NONE)
+        {
+            return luaL_error(L, "malformed job arguments");
+        }
+        lua_call(L, NumArgs, LUA_MULTRET);
+        //module, results...
+        return lua_gettop(L) - 1;
+    }
+
+    static int OpenWorkerState(lua_State* L)
+    {
+        luaL_openlibs(L);
+        //OnLuaLoadFile is bound by game code which may not expect calls from other threads
+        RegisterCustomLoader(L, true);
+        return 0;
+    }
+
+    void RunJob(lua_State* L, FLuaStatePoolJob& Job)
+    {
+        SCOPE_CYCLE_COUNTER(STAT_LuaPoolJob);
+
+        FLuaStatePoolResult Result;
+        FString Error = TEXT("the worker has no lua state");
+
+        if (L)
+        {
+            FTCHARToUTF8 ModuleName(*Job.ModuleName);
+            FTCHARToUTF8 FunctionName(*Job.FunctionName);
+            FJobCall Call{ ModuleName.Get(), FunctionName.Get(), &Job.Args };
+            lua_settop(L, 0);
+            lua_pushcfunction(L, CallJob);
+            lua_pushlightuserdata(L, &Call);
+            if (lua_pcall(L, 1, LUA_MULTRET, 0) != LUA_OK)
+            {
+                Error = lua_isstring(L, -1) ? UTF8_TO_TCHAR(lua_tostring(L, -1)) : TEXT("job failed");
+            }
+            else
+            {
+                //results...
+                Result.bSuccess = LuaJobSerializer::Write(L, 1, Result.Data, Error);
+            }
+            lua_settop(L, 0);
+        }
+
+        if (!Result.bSuccess)
+        {
+            INC_DWORD_STAT(STAT_LuaPoolJobsFailed);
+            Result.Data.Reset();
+            LuaJobSerializer::WriteError(Error, Result.Data);
+        }
+
+        Pool->CompleteJob(Job.JobId, MoveTemp(Result));
+    }
+
+public:
+    FLuaStatePoolWorker(ULuaStatePool* InPool, int32 WorkerIndex)
+        : Pool(InPool)
+    {
+        WakeEvent = FPlatformProcess::GetSynchEventFromPool();
+        Thread = FRunnableThread::Create(this, *FString::Printf(TEXT("LuaStatePoolWorker%d"), WorkerIndex));
+    }
+
+    virtual ~FLuaStatePoolWorker() override
+    {
+        if (Thread)
+        {
+            Thread->Kill(true);
+            delete Thread;
+        }
+        FPlatformProcess::ReturnSynchEventToPool(WakeEvent);
+    }
+
+    int32 GetPendingNum() const
+    {
+        return PendingNum.load(std::memory_order_relaxed);
+    }
+
+    void Enqueue(FLuaStatePoolJob&& Job)
+    {
+        PendingNum.fetch_add(1, std::memory_order_relaxed);
+        Jobs.Enqueue(MoveTemp(Job));
+        WakeEvent->Trigger();
+    }
+
+    virtual uint32 Run() override
+    {
+        //the state never leaves this thread, so it is created here and needs no lock hooks
+        lua_State* L = lua_newstate(&FLuaSourceModule::LuaMalloc, nullptr);
+        if (L)
+        {
+            //there is no panic handler, nothing on a worker may raise outside a protected call
+            lua_pushcfunction(L, OpenWorkerState);
+            if (lua_pcall(L, 0, 0, 0) != LUA_OK)
+            {
+                UE_LOG(LogTemp, Error, TEXT("Lua pool worker: %s"), lua_isstring(L, -1) ? UTF8_TO_TCHAR(lua_tostring(L, -1)) : TEXT("can not open the libraries"));
+                lua_close(L);
+                L = nullptr;
+            }
+        }
+
+        while (!bStopping.load(std::memory_order_relaxed))
+        {
+            FLuaStatePoolJob Job;
+            while (!bStopping.load(std::memory_order_relaxed) && Jobs.Dequeue(Job))
+            {
+                RunJob(L, Job);
+                PendingNum.fetch_sub(1, std::memory_order_relaxed);
+            }
+            WakeEvent->Wait();
+        }
+
+        if (L)
+        {
+            lua_close(L);
+        }
+        return 0;
+    }
+
+    virtual void Stop() override
+    {
+        bStopping.store(true, std::memory_order_relaxed);
+        WakeEvent->Trigger();
+    }
+};
+
+void ULuaStatePool::CompleteJob(int64 JobId, FLuaStatePoolResult&& Result)
+{
+    FScopeLock Lock(&CompletedLock);
+    CompletedJobs.Add(JobId, MoveTemp(Result));
+}
+
+void ULuaStatePool::BeginDestroy()
+{
+    Finalize();
+    Super::BeginDestroy();
+}
+
+void ULuaStatePool::Init(int32 NumWorkers)
+{
+    Finalize();
+    if (NumWorkers <= 0)
+    {
+        NumWorkers = FMath::Max(1, FPlatformMisc::NumberOfWorkerThreadsToSpawn());
+    }
+    Workers.Reserve(NumWorkers);
+    for (int32 WorkerIndex = 0; WorkerIndex < NumWorkers; ++WorkerIndex)
+    {
+        Workers.Add(new FLuaStatePoolWorker(this, WorkerIndex));
+    }
+}
+
+void ULuaStatePool::Finalize()
+{
+    for (FLuaStatePoolWorker* Worker : Workers)
+    {
+        delete Worker;
+    }
+    Workers.Empty();
+
+    FScopeLock Lock(&CompletedLock);
+    CompletedJobs.Empty();
+}
+
+int64 ULuaStatePool::Dispatch(const FString& ModuleName, const FString& FunctionName, TArray<uint8>&& Args)
+{
+    if (Workers.Num() == 0)
+    {
+        return INDEX_NONE;
+    }
+
+    FLuaStatePoolWorker* Target = Workers[0];
+    for (FLuaStatePoolWorker* Worker : Workers)
+    {
+        if (Worker->GetPendingNum() < Target->GetPendingNum())
+        {
+            Target = Worker;
+        }
+    }
+
+    FLuaStatePoolJob Job;
+    Job.JobId = LastJobId.fetch_add(1, std::memory_order_relaxed) + 1;
+    Job.ModuleName = ModuleName;
+    Job.FunctionName = FunctionName;
+    Job.Args = MoveTemp(Args);
+    const int64 JobId = Job.JobId;
+    Target->Enqueue(MoveTemp(Job));
+    INC_DWORD_STAT(STAT_LuaPoolJobsDispatched);
+    return JobId;
+}
+
+bool ULuaStatePool::Poll(int64 JobId, FLuaStatePoolResult& OutResult)
+{
+    FScopeLock Lock(&CompletedLock);
+    return CompletedJobs.RemoveAndCopyValue(JobId, OutResult);
+}
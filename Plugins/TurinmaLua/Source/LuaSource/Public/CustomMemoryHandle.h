@@ -204,14 +204,18 @@ public:
 	FCustomMemoryItemBase(FCustomMemoryItemBase&& OtherTemp);
 	virtual ~FCustomMemoryItemBase();
 
-	FCustomMemoryItemBase& operator=(const FCustomMemoryItemBase& InOther) = default;
+	FCustomMemoryItemBase& operator=(const FCustomMemoryItemBase& InOther)
+	{
+		return *this; //the slot belongs to this object, nothing to take from the other one
+	}
 
 	virtual bool IsCustomMemoryItemValid() const { return true; }
 	virtual void DestroyCustomMomoryItem(){};
 
 	bool IsInterface() const {return bIsInterface;}
 
-	mutable unsigned int checkid = 0xffffffff;
+	//atomic because debug builds read it from GetPtr on other threads while Unsign may clear it
+	mutable std::atomic<unsigned int> checkid{ 0xffffffff };
 private:
 	mutable FNewCustormMemoryIdPair NewCustomMemoryPair;
 	void Assign();
@@ -229,9 +233,14 @@ class LUASOURCE_API FCustomMemoryItemThirdParty : public FCustomMemoryItemBase
 
 
 
+struct FCustomMemorySlotTable;
+
 class LUASOURCE_API FCustomMemoryHandleBase
 {
 	friend class FCustomMemoryItemBase;
+	friend struct FCustomMemorySlotTable;
+	friend class FCustomMemoryUnsignBatch;
+	friend class FCustomMemoryAssignBatch;
 public:
 	virtual ~FCustomMemoryHandleBase() = default;
 
@@ -240,51 +249,33 @@ protected:
 	 
 	FCustomMemoryItemBase* GetPtr()
 	{
+		return const_cast<FCustomMemoryItemBase*>(static_cast<const FCustomMemoryHandleBase*>(this)->GetPtr());
+	}
+	//Slots never move and check ids are never reused, so one acquire load of the slot tells whether the item
+	//we were assigned to is still alive; it pairs with the release stores in Assign/Unsign and never waits.
+	//Like any raw pointer, the result is only safe to use while the item is not destroyed concurrently.
+	const FCustomMemoryItemBase* GetPtrTrusted() const
+	{
+		if (NewInnerIdPair.PtrPair == nullptr)
 		{
-			if (NewInnerIdPair.PtrPair == nullptr)
-			{
-				return nullptr;
-			}
-#if !KF_VALID_SERVER
-			while (NewCurrentOperateIndex() == NewInnerIdPair.PtrPair) {} //slot is operating, spin and wait
-#endif
-			auto& ItemPtr = *NewInnerIdPair.PtrPair;// ItemPtrs[InnerIdPair.Index];
-			if (ItemPtr.CheckIndex != NewInnerIdPair.CheckIndex)
-			{
-				return nullptr;
-			}
-			auto& ItemBasePtr = ItemPtr.ItemBase;
-#if	!UE_BUILD_SHIPPING && !KF_VALID_SERVER
-			checkf(ItemBasePtr, TEXT("ItemBasePtr should not be null"));
-			checkf(ItemBasePtr->checkid == 0xffffffff, TEXT("ItemBasePtr Object: invalid checkid"));
-#endif
-
-#if KF_VALID_SERVER
-			return ItemBasePtr;
-#else 
-			return (ItemBasePtr->IsCustomMemoryItemValid()) ? ItemBasePtr : nullptr;
-#endif
+			return nullptr;
 		}
+		if (NewInnerIdPair.PtrPair->CheckIndex.load(std::memory_order_acquire) != NewInnerIdPair.CheckIndex)
+		{
+			return nullptr;
+		}
+		return NewInnerIdPair.ItemBase;
 	}
 	const FCustomMemoryItemBase* GetPtr() const
 	{
 		{
-			if (NewInnerIdPair.PtrPair == nullptr)
+			auto* ItemBasePtr = GetPtrTrusted();
+			if (ItemBasePtr == nullptr)
 			{
 				return nullptr;
 			}
-#if !KF_VALID_SERVER
-			while (NewCurrentOperateIndex() == NewInnerIdPair.PtrPair) {} //slot is operating, spin and wait
-#endif
-			auto& ItemPtr = *NewInnerIdPair.PtrPair;// ItemPtrs[InnerIdPair.Index];
-			if (ItemPtr.CheckIndex != NewInnerIdPair.CheckIndex)
-			{
-				return nullptr;
-			}
-			auto& ItemBasePtr = ItemPtr.ItemBase;
 #if	!UE_BUILD_SHIPPING && !KF_VALID_SERVER
-			checkf(ItemBasePtr, TEXT("ItemBasePtr should not be null"));
-			checkf(ItemBasePtr->checkid == 0xffffffff, TEXT("ItemBasePtr Object: invalid checkid %d"), ItemBasePtr->checkid);
+			checkf(ItemBasePtr->checkid.load(std::memory_order_relaxed) == 0xffffffff, TEXT("ItemBasePtr Object: invalid checkid %d"), ItemBasePtr->checkid.load(std::memory_order_relaxed));
 #endif
 
 #if KF_VALID_SERVER
@@ -296,25 +287,30 @@ protected:
 	}
 private:
 
+	//one slot of the global slot table, lives in a chunk that is never freed or moved
 	struct FCustormMemoryPtrPair
 	{
 		friend class FCustomMemoryHandleBase;
+		friend struct FCustomMemorySlotTable;
 	private:
-		long long int CheckIndex = -1;
-		FCustomMemoryItemBase* ItemBase = nullptr;
+		std::atomic<long long int> CheckIndex{ -1 };
+		std::atomic<unsigned int> NextFree{ 0 }; //free list link, index + 1 of the next free slot, 0 ends the list
+		unsigned int SlotIndex = 0;
 	};
 	
 	struct NewInnerFCustormMemoryIdPair
 	{
 		friend class FCustomMemoryHandleBase;
 	public:
-		void CopyFrom(const FNewCustormMemoryIdPair& Other)
+		void CopyFrom(const FNewCustormMemoryIdPair& Other, const FCustomMemoryItemBase* InItemBase)
 		{
 			PtrPair = reinterpret_cast<FCustormMemoryPtrPair*>(Other.PtrPair);
 			CheckIndex = Other.CheckIndex;
+			ItemBase = const_cast<FCustomMemoryItemBase*>(InItemBase);
 		}
 		FCustormMemoryPtrPair* PtrPair = nullptr;
 		long long int CheckIndex = -1;
+		FCustomMemoryItemBase* ItemBase = nullptr;
 	};
 
 	NewInnerFCustormMemoryIdPair NewInnerIdPair;
@@ -324,15 +320,8 @@ protected:
 	static KFSpinMutex& ItemMutex();
 #endif
 private:
-	static long long& CurrentCheckId();
 	static std::unordered_map<const FCustomMemoryItemBase*, FNewCustormMemoryIdPair>& NewCustomMemoryItemMap();
-	static std::list<FCustormMemoryPtrPair>& NewCustomMemoryItemPtrs();
-	static std::vector<FCustormMemoryPtrPair*>& NewUnusedIndices();
-
 
-#if !KF_VALID_SERVER
-	static FCustormMemoryPtrPair*& NewCurrentOperateIndex();
-#endif
 protected:
 	static void Assign(const FCustomMemoryItemBase* InItemBase);
 	static void Unsign(const FCustomMemoryItemBase* InItemBase);
@@ -342,15 +331,15 @@ protected:
 		{
 			NewInnerIdPair.PtrPair = nullptr;
 			NewInnerIdPair.CheckIndex = -1;
+			NewInnerIdPair.ItemBase = nullptr;
 			return;
 		}
-#if !KF_VALID_SERVER
-		ItemMutex().lock();
-#endif
+		//the pair of a living item never changes, no lock needed to read it
 		FNewCustormMemoryIdPair& IdPair = InItemBase->NewCustomMemoryPair;
 
 #if CHECK_ITEM_PAIR
 		{
+			std::lock_guard<KFSpinMutex> Lock(ItemMutex());
 			auto It = NewCustomMemoryItemMap().find(InItemBase);
 			if (It != NewCustomMemoryItemMap().end())
 			{
@@ -359,10 +348,7 @@ protected:
 		}
 #endif
 
-		NewInnerIdPair.CopyFrom(IdPair);
-#if !KF_VALID_SERVER
-		ItemMutex().unlock();
-#endif	
+		NewInnerIdPair.CopyFrom(IdPair, InItemBase);
 	}
 public:
 	std::tuple<void*, long long int> GetInnerPair() const {
@@ -372,6 +358,37 @@ public:
 	}
 };
 
+//Items constructed on this thread while this is alive take their slots and check ids from one reservation of Num,
+//made of free slots first and fresh ones for the rest. Slots not used are given back at the end.
+class LUASOURCE_API FCustomMemoryAssignBatch
+{
+public:
+	explicit FCustomMemoryAssignBatch(int Num);
+	~FCustomMemoryAssignBatch();
+
+	FCustomMemoryAssignBatch(const FCustomMemoryAssignBatch&) = delete;
+	FCustomMemoryAssignBatch& operator=(const FCustomMemoryAssignBatch&) = delete;
+private:
+	std::vector<FCustomMemoryHandleBase::FCustormMemoryPtrPair*> Slots;
+	std::vector<FCustomMemoryHandleBase::FCustormMemoryPtrPair*>* OuterSlots = nullptr;
+	bool bReserved = false;
+};
+
+//Items destroyed on this thread while this is alive give their slots back all at once when it ends.
+//Their handles are invalidated immediately, only the slot reuse is deferred.
+class LUASOURCE_API FCustomMemoryUnsignBatch
+{
+public:
+	FCustomMemoryUnsignBatch();
+	~FCustomMemoryUnsignBatch();
+
+	FCustomMemoryUnsignBatch(const FCustomMemoryUnsignBatch&) = delete;
+	FCustomMemoryUnsignBatch& operator=(const FCustomMemoryUnsignBatch&) = delete;
+private:
+	std::vector<FCustomMemoryHandleBase::FCustormMemoryPtrPair*> PendingSlots;
+	std::vector<FCustomMemoryHandleBase::FCustormMemoryPtrPair*>* OuterPendingSlots = nullptr;
+};
+
 struct TbInterfaceTrue {};
 struct TbInterfaceFalse {};
 
@@ -603,6 +620,54 @@ TCustomMemoryHandle<HandledClass>::Get_Internal() const
 	return nullptr;
 }
 
+//Handle that only checks that the item is still alive and skips the virtual IsCustomMemoryItemValid callback.
+//Use it for item types that do not override IsCustomMemoryItemValid, or where the caller checks validity itself.
+template<typename HandledClass>
+class TTrustedCustomMemoryHandle final : public FCustomMemoryHandleBase
+{
+	static_assert(std::is_base_of<FCustomMemoryItemBase, HandledClass>::value, "HandledClass must inherit form FCustomMemoryItemBase");
+public:
+	using HandledType = HandledClass;
+
+	TTrustedCustomMemoryHandle() = default;
+	TTrustedCustomMemoryHandle(decltype(nullptr)) {}
+	TTrustedCustomMemoryHandle(const HandledClass* InOrigin)
+	{
+		AssignToMe(static_cast<const FCustomMemoryItemBase*>(InOrigin));
+	}
+	explicit TTrustedCustomMemoryHandle(const TCustomMemoryHandle<HandledClass>& InHandle) : FCustomMemoryHandleBase(InHandle) {}
+
+	TTrustedCustomMemoryHandle<HandledClass>& operator=(decltype(nullptr))
+	{
+		AssignToMe(nullptr);
+		return *this;
+	}
+
+	HandledClass* Get() const
+	{
+		return const_cast<HandledClass*>(static_cast<const HandledClass*>(GetPtrTrusted()));
+	}
+
+	bool operator==(const TTrustedCustomMemoryHandle<HandledClass>& Other) const
+	{
+		return Get() == Other.Get();
+	}
+
+	bool operator==(const HandledClass* Other) const
+	{
+		return Get() == Other;
+	}
+
+	operator bool() const { return nullptr != Get(); }
+
+	HandledClass* operator->() const
+	{
+		auto* innerPtr = Get();
+		check(innerPtr);
+		return innerPtr;
+	}
+};
+
 template<typename HandledClass>
 class TConstCustomMemoryHandle final
 {
@@ -0,0 +1,36 @@
+// Copyright Epic Games, Inc. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "lua.hpp"
+
+class UScriptStruct;
+
+/**
+ * Value types for the math structs lua scripts use the most: FVector, FRotator, FQuat, FTransform and packed arrays of
+ * FVector. They are plain userdata holding the value, with C++ metamethods and no __gc, so a temporary of an
+ * expression costs one lua allocation and nothing else. Registered as the global UEMath table. UFunction return and
+ * out values of these structs come back as these values, properties stay write-through views, and both accept them.
+ */
+namespace LuaMath
+{
+	/** Create the metatables and the UEMath global */
+	LUASOURCE_API void Register(lua_State* L);
+
+	LUASOURCE_API void PushVector(lua_State* L, const FVector& Value);
+	LUASOURCE_API void PushRotator(lua_State* L, const FRotator& Value);
+	LUASOURCE_API void PushQuat(lua_State* L, const FQuat& Value);
+	LUASOURCE_API void PushTransform(lua_State* L, const FTransform& Value);
+
+	/** The value at Index, null if it is not of that type */
+	LUASOURCE_API FVector* ToVector(lua_State* L, int Index);
+	LUASOURCE_API FRotator* ToRotator(lua_State* L, int Index);
+	LUASOURCE_API FQuat* ToQuat(lua_State* L, int Index);
+	LUASOURCE_API FTransform* ToTransform(lua_State* L, int Index);
+
+	/** Push the struct at Value as a math value, returns false if Struct is not one of the math structs */
+	LUASOURCE_API bool PushStruct(lua_State* L, const UScriptStruct* Struct, const void* Value);
+	/** Copy the math value at Index into Value, returns false unless it holds a Struct */
+	LUASOURCE_API bool ToStruct(lua_State* L, int Index, const UScriptStruct* Struct, void* Value);
+}
@@ -0,0 +1,60 @@
+// Copyright Epic Games, Inc. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+/**
+ * Every lua module of the project compiled into one file, so a cooked build opens a single file instead of one per require.
+ * Layout: FHeader, NumModules FIndexEntry sorted by name, the UTF-8 names, then the bytecode blobs aligned to BlobAlignment.
+ * Modules are named by their long package name, e.g. /Game/Foo/Bar for Content/Foo/Bar.lua.
+ */
+class LUASOURCE_API FLuaScriptBundle
+{
+public:
+	static constexpr uint32 FileMagic = 0x42534C54; //TLSB
+	static constexpr uint32 FileVersion = 1;
+	static constexpr int32 BlobAlignment = 16;
+
+	struct FHeader
+	{
+		uint32 Magic;
+		uint32 Version;
+		uint32 LuaVersion;
+		uint32 NumModules;
+	};
+
+	struct FIndexEntry
+	{
+		uint32 NameOffset;
+		uint32 NameLength;
+		uint64 BlobOffset;
+		uint64 BlobSize;
+	};
+
+	/** Where the cook writes the bundle and where cooked builds look for it */
+	static FString GetDefaultPath();
+
+	/** Read and validate a bundle, returns null if the file is missing or malformed */
+	static TUniquePtr<FLuaScriptBundle> Load(const FString& FileName);
+
+	/** Bytecode of the module with this long package name, empty if the bundle does not have it */
+	TConstArrayView<uint8> Find(FUtf8StringView PackageName) const;
+
+	int32 GetNumModules() const { return NumModules; }
+
+#if WITH_EDITOR
+	/** Compile every .lua file under the mounted content paths into a bundle at FileName */
+	static bool Build(const FString& FileName, bool bStripDebugInfo);
+#endif
+
+private:
+	TArray<uint8> Data;
+	const FIndexEntry* Index = nullptr;
+	int32 NumModules = 0;
+
+	FUtf8StringView GetName(const FIndexEntry& Entry) const
+	{
+		return FUtf8StringView((const UTF8CHAR*)Data.GetData() + Entry.NameOffset, Entry.NameLength);
+	}
+};
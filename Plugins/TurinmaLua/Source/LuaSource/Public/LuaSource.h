@@ -5,22 +5,43 @@
 #include "CoreMinimal.h"
 #include "lua.hpp"
 #include "Modules/ModuleManager.h"
+#include "Async/Mutex.h"
+#include "Tickable.h"
 #include "CustomMemoryHandle.h"
+#include "LuaStateAllocator.h"
 #include "LuaSource.generated.h"
 
 DECLARE_DELEGATE_RetVal_TwoParams(bool, FOnLuaLoadFile, const FString&, FString&);
+/** Same as FOnLuaLoadFile with the raw file bytes, UTF-8 sources reach lua without being transcoded */
+DECLARE_DELEGATE_RetVal_TwoParams(bool, FOnLuaLoadFileBytes, const FString&, TArray<uint8>&);
+
+DECLARE_STATS_GROUP(TEXT("TurinmaLua"), STATGROUP_TurinmaLua, STATCAT_Advanced);
+
+class ULuaStatePool;
 
 #define MAKE_LUA_METATABLE_NAME(ClassName) "*LMN*" #ClassName "*end*"
 
 EXTERN_C
 {
 	struct GCObject;
+	struct Table;
+	struct TValue;
 }
 
 namespace LuaCPPAPI
 {
+	/** Work stacks reused between heap walks, so a warmed up walk does not allocate */
+	struct FLuaHeapWalkContext
+	{
+		TArray<GCObject*> StrongStack;
+		TArray<GCObject*> WeakStack;
+		int32 PeakStackNum = 0;
+	};
+
 	void luaC_foreachgcobj(lua_State* L, TFunction<void(GCObject*, bool, lua_State*)> cb);
-	
+
+	/** Visit every object reachable from the roots once, strong ones first; with bUserdataOnly only userdata reach the callback */
+	void luaC_foreachgcobj(lua_State* L, FLuaHeapWalkContext& Context, TFunctionRef<void(GCObject*, bool, lua_State*)> cb, bool bUserdataOnly = false);
 }
 
 
@@ -63,12 +84,22 @@ struct FLuaUStructRefData
 	}
 };
 
+struct FLuaStructReferenceSchema;
+
 struct FLuaUStructData
 {
 	static constexpr int32 MaxInlineSize = sizeof(FTransform) > sizeof(void*) ? sizeof(FTransform) : sizeof(void*);
 
 	UScriptStruct* StructType;
 	TAlignedBytes<MaxInlineSize, alignof(std::max_align_t)> InnerData;
+	/** GetStructureSize of StructType, cached by SetData */
+	int32 DataSize;
+	/** Slab size class of an out of line payload, INDEX_NONE when it came straight from FMemory */
+	int16 SizeClass;
+	/** Cached UObject reference layout of StructType, resolved by SetData */
+	const FLuaStructReferenceSchema* RefSchema;
+	/** The payload lives in InnerData, otherwise InnerData holds a pointer to it */
+	bool bInline;
 	bool bValid;
 
 	bool IsDataValid() const
@@ -80,9 +111,17 @@ struct FLuaUStructData
 
 	void CopyData(void* Data);
 
-	void SetData(UScriptStruct* Type, void* Data);
+	/** Null Data gives the default value, otherwise the payload is copy constructed from Data or, with bMove, takes over its heap memory */
+	void SetData(UScriptStruct* Type, void* Data, bool bMove = false);
 
-	void* GetData();
+	void* GetData()
+	{
+		if(!bValid)
+		{
+			return nullptr;
+		}
+		return bInline ? (void*)&InnerData : *(void**)(&InnerData);
+	}
 	
 	void AddReferencedObjects(UObject* Owner, FReferenceCollector& Collector, bool bStrong);
 };
@@ -118,7 +157,47 @@ struct FLuaUEData : public FCustomMemoryItemThirdParty
 	} Data;
 	EUEDataType DataType = EUEDataType::None;
 
-	TOptional<TCustomMemoryHandle<FLuaUEData>> Oter;
+	TOptional<TTrustedCustomMemoryHandle<FLuaUEData>> Oter;
+
+	/** Slot in the owning ULuaState's live userdata registry, INDEX_NONE when not registered */
+	int32 RegistryIndex = INDEX_NONE;
+
+	/** Memory the properties of the pushed type are read from */
+	void* GetContainer()
+	{
+		switch (DataType)
+		{
+		case EUEDataType::Struct:
+			return Data.Struct.GetData();
+		case EUEDataType::StructRef:
+			return Data.StructRef.PtrToData;
+		case EUEDataType::Object:
+			return Data.Object.Object;
+		default:
+			return nullptr;
+		}
+	}
+
+	UStruct* GetStruct() const
+	{
+		switch (DataType)
+		{
+		case EUEDataType::Struct:
+			return Data.Struct.StructType;
+		case EUEDataType::StructRef:
+			return Data.StructRef.StructType;
+		case EUEDataType::Object:
+			return Data.Object.Object ? Data.Object.Object->GetClass() : nullptr;
+		default:
+			return nullptr;
+		}
+	}
+
+	/** Validity of a struct or object that views borrow from, views themselves never own other views */
+	bool IsOwnerValid() const
+	{
+		return DataType == EUEDataType::Object ? Data.Object.IsDataValid() : DataType == EUEDataType::Struct && Data.Struct.IsDataValid();
+	}
 
 	bool IsDataValid() const
 	{
@@ -129,11 +208,9 @@ struct FLuaUEData : public FCustomMemoryItemThirdParty
 
 		if(DataType == EUEDataType::StructRef)
 		{
-			if(Oter.IsSet())
-			{
-				return Oter.GetValue() && Oter.GetValue()->IsDataValid() && Data.StructRef.IsDataValid();
-			}
-			return false;
+			//views are always rooted at a struct or object owner, one generation compare of the handle tells if it still exists
+			const FLuaUEData* Owner = Oter.IsSet() ? Oter.GetValue().Get() : nullptr;
+			return Owner && Data.StructRef.IsDataValid() && Owner->IsOwnerValid();
 		}
 
 		if(DataType == EUEDataType::Object)
@@ -181,7 +258,7 @@ struct FLuaUEData : public FCustomMemoryItemThirdParty
 			Data.Struct.AddReferencedObjects(Owner, Collector, bStrong);
 			break;
 		case EUEDataType::Object:
-			Data.Struct.AddReferencedObjects(Owner, Collector, bStrong);
+			Data.Object.AddReferencedObjects(Owner, Collector, bStrong);
 			break;
 		case EUEDataType::StructRef:
 			break;
@@ -192,6 +269,65 @@ struct FLuaUEData : public FCustomMemoryItemThirdParty
 };
 
 
+class ULuaState;
+
+/** Typed access to one property, shared by every userdata of the owning struct in one lua state */
+struct FLuaPropertyAccessor
+{
+	/** Push the value at Value, returns the number of pushed values. Owner is the UE userdata at 1 of L, null for parameters */
+	using FGetter = int(*)(ULuaState* LuaState, lua_State* L, FLuaUEData* Owner, void* Value, const FProperty* Property);
+	/** Store the lua value at Index into Value, returns false if it has the wrong type */
+	using FSetter = bool(*)(lua_State* L, int Index, void* Value, const FProperty* Property);
+
+	const FProperty* Property = nullptr;
+	int32 Offset = 0;
+	FGetter Get = nullptr;
+	/** Null for properties lua may only read */
+	FSetter Set = nullptr;
+
+	/** Pick the fastest getter and setter for Property, types without a dedicated path are exported as text and read only */
+	static FLuaPropertyAccessor Make(const FProperty* Property);
+};
+
+/** How the arguments of one UFunction are marshalled, built on its first call from lua and reused after */
+struct FLuaFunctionCallPlan
+{
+	struct FParam
+	{
+		FLuaPropertyAccessor Accessor;
+		/** Read from the lua arguments, in declaration order */
+		bool bIn = false;
+		/** Returned to lua after the call, the return value comes first */
+		bool bOut = false;
+		/** Zeroed memory is not a valid value, InitializeValue must run */
+		bool bNeedsInit = false;
+		bool bNeedsDestroy = false;
+	};
+
+	TWeakObjectPtr<UFunction> Function;
+	TArray<FParam> Params;
+	int32 ReturnParam = INDEX_NONE;
+	int32 ParmsSize = 0;
+	int32 Alignment = 1;
+	bool bNeedsInit = false;
+	bool bNeedsDestroy = false;
+	bool bBuilt = false;
+
+	void Build();
+};
+
+struct FLuaTypeMetatable
+{
+	TWeakObjectPtr<const UStruct> Struct;
+	Table* Metatable = nullptr;
+};
+
+struct FLuaUEDataRegistryEntry
+{
+	FLuaUEData* UEData;
+	bool bStrong;
+};
+
 UCLASS(BlueprintType, MinimalAPI)
 class UCompleteObject : public UObject
 {
@@ -249,35 +385,180 @@ class ATestWeakRefPtr : public AActor
 };
 
 
+UENUM(BlueprintType)
+enum class ELuaThreadingMode : uint8
+{
+	/** Only the thread that called Init uses the state, entering lua is just an owner check */
+	SingleThread,
+	/** Any thread may enter, a contended thread spins briefly and then parks */
+	Shared,
+	/** Same as Shared, and also counts contended entries and the time spent waiting */
+	DebugContention,
+};
+
+UENUM(BlueprintType)
+enum class ELuaGCMode : uint8
+{
+	/** The collector stays stopped and a full collection runs after every UE garbage collection */
+	StopTheWorld,
+	/** Incremental steps every frame, bounded by GCBudgetMicroseconds */
+	Incremental,
+	/** One young collection every frame that allocated, the budget does not apply */
+	Generational,
+};
+
 UCLASS(BlueprintType, MinimalAPI)
-class ULuaState : public UObject
+class ULuaState : public UObject, public FTickableGameObject
 {
 	GENERATED_BODY()
 
+	friend class FLuaSourceModule;
+
 	void PostGarbageCollect();
 
+	/** Only states owned by the game thread are stepped from Tick, others call StepGC themselves */
+	bool bTickGC = false;
+	/** Set by LuaMalloc when lua allocated GCPressureKB since the last step, StepGC applies it */
+	bool bGCPressure = false;
+	/** Set when StepGC let the collector run on its own until the next step */
+	bool bGCRunning = false;
+	/** Bytes lua allocated since the last collection step, fed by LuaMalloc */
+	SIZE_T AllocatedSinceGCStep = 0;
+	/** Heap size last added to STAT_LuaHeapSize */
+	int64 ReportedHeapBytes = 0;
+	/** Exact size of every live lua block, kept by LuaMalloc from osize and nsize */
+	std::atomic<SIZE_T> AllocatedBytes = 0;
+
+	void OnLuaAllocated(SIZE_T Bytes);
+	bool CanAllocate(SIZE_T Bytes) const;
+	void ReportMemory();
+
+	/** Set between Init and Finalize when bUsePooledAllocator is on */
+	TUniquePtr<FLuaStateAllocator> Allocator;
+
 	friend void LuaLock(lua_State*);
 	friend void LuaUnLock(lua_State*);
 	lua_State* InnerState = nullptr;
 	
 	static thread_local uint64 LocalThreadId;
-	static thread_local uint64 EnterCount;
-	
-	uint64 LockedThreadId = 0xffffffffffffffff;
-	std::atomic_flag LuaAt = ATOMIC_FLAG_INIT;
+	static uint64 GetLocalThreadId();
+
+	uint64 OwnerThreadId = 0xffffffffffffffff;
+	std::atomic<uint64> LockedThreadId = 0xffffffffffffffff;
+	uint32 EnterCount = 0;
+	UE::FMutex LuaMutex;
+
+	std::atomic<uint64> ContendedLockNum = 0;
+	std::atomic<uint64> ContendedLockCycles = 0;
+
+	LuaCPPAPI::FLuaHeapWalkContext HeapWalkContext;
+
+	friend int OnDestroyUEDataInLua(lua_State*);
+
+	/** The LuaUEDataMetatableName table resolved at Init, the metatable of every type metatable, so it identifies UE userdata */
+	Table* UEDataMetatable = nullptr;
+
+	/** The UObjectCacheTableName table resolved at Init, UObject pointer to the weakly held userdata already pushed for it */
+	Table* UObjectCache = nullptr;
+
+	/** Every FLuaUEData alive in this state, so reference collection does not need to walk the lua heap */
+	TArray<FLuaUEDataRegistryEntry> LiveUEData;
+
+	void RegisterUEData(FLuaUEData* LuaUD);
+	void UnregisterUEData(FLuaUEData* LuaUD);
 
 	void OnCollectLuaRefs(FReferenceCollector& Collector, GCObject* o, bool w, lua_State* l);
 	void LockLua();
 	void UnlockLua();
 
-	LUASOURCE_API void PushLuaUEData(void* Value, UStruct* DataType, EUEDataType Type, TCustomMemoryHandle<FLuaUEData> Oter);
+	friend FLuaUEData* ToUEData(lua_State*, int);
+	friend int UEDataIndex(lua_State*);
+	friend int UEDataNewIndex(lua_State*);
+	friend int UEDataCallFunction(lua_State*);
+	friend const TValue* FindUEDataField(lua_State*, FLuaUEData*);
+	friend int PushCallResult(ULuaState*, lua_State*, const FLuaFunctionCallPlan::FParam&, uint8*);
+	friend int PushUEDataCall(lua_State*);
+	friend int OpenStateLibs(lua_State*);
+
+	/**
+	 * Metatable per pushed type, built on first use and anchored in the UEDataMetatableTableName registry table.
+	 * Besides the metamethods it maps every property name of the type and its supers to a FLuaPropertyAccessor
+	 * light userdata and every function name to a closure calling it.
+	 */
+	TMap<const UStruct*, FLuaTypeMetatable> TypeMetatables;
+	TArray<TUniquePtr<FLuaPropertyAccessor>> PropertyAccessors;
+	/** One per UFunction of the classes in TypeMetatables, the upvalue of the closure that calls it */
+	TArray<TUniquePtr<FLuaFunctionCallPlan>> CallPlans;
+	FLuaCallFrameStack CallFrames;
+
+	/** Built with L, any thread of this state, everything it pushes is popped again */
+	Table* GetTypeMetatable(lua_State* L, const UStruct* Struct);
+	/** Accessor for a dotted path of struct members below Struct, with the offsets of every step added up, null if it does not resolve */
+	const FLuaPropertyAccessor* ResolvePropertyPath(const UStruct* Struct, const char* Path);
+	bool IsUEDataMetatable(const Table* Metatable) const;
+	/** Called when types are reinstanced, the next push of every type builds a new metatable */
+	void ResetTypeMetatables();
+
+	/** Push onto L, the main thread of this state or one of its coroutines */
+	LUASOURCE_API void PushLuaUEData(lua_State* L, void* Value, UStruct* DataType, EUEDataType Type, TCustomMemoryHandle<FLuaUEData> Oter, bool bMove = false);
 	LUASOURCE_API void PushUStructCopy(void* Value, UScriptStruct* DataType);
+	/** PushLuaUEData onto the main thread under lua_pcall, for C++ callers that have no lua call around them, logs and pushes nothing on error */
+	LUASOURCE_API void PushLuaUEDataProtected(void* Value, UStruct* DataType, EUEDataType Type, bool bMove = false);
 public:
 
+	/** How lua_lock behaves for this state, must be chosen before Init */
+	UPROPERTY(EditAnywhere, BlueprintReadWrite)
+	ELuaThreadingMode ThreadingMode = ELuaThreadingMode::Shared;
+
+	/** How the lua collector is driven, must be chosen before Init */
+	UPROPERTY(EditAnywhere, BlueprintReadWrite)
+	ELuaGCMode GCMode = ELuaGCMode::Incremental;
+
+	/** Time each frame may spend in incremental collection steps */
+	UPROPERTY(EditAnywhere, BlueprintReadWrite)
+	float GCBudgetMicroseconds = 500.f;
+
+	/** Once lua allocates this much between two steps the collector also runs on allocation until the next step, 0 disables */
+	UPROPERTY(EditAnywhere, BlueprintReadWrite)
+	int32 GCPressureKB = 8 * 1024;
+
+	/** Allocations that would take the state past this fail and lua raises a memory error, 0 disables */
+	UPROPERTY(EditAnywhere, BlueprintReadWrite)
+	int32 MemoryLimitKB = 0;
+
+	/** Serve small lua blocks from per state size class pools, released all at once by Finalize, must be chosen before Init */
+	UPROPERTY(EditAnywhere, BlueprintReadWrite)
+	bool bUsePooledAllocator = false;
+
+	/** Pool the LuaJobs.Dispatch/LuaJobs.Poll functions of this state send their jobs to */
+	UPROPERTY(EditAnywhere, BlueprintReadWrite)
+	TObjectPtr<ULuaStatePool> JobPool;
+
 	static const char* const LuaUEDataMetatableName;
+	static const char* const UObjectExtensionWeakTableName;
+	static const char* const UObjectExtensionStrongTableName;
+	static const char* const UEDataMetatableTableName;
+	static const char* const UObjectCacheTableName;
+
+	/** Move the UE userdata at Index into the strong or the weak extension table, a weak one no longer keeps its UObjects alive */
+	LUASOURCE_API void SetUEDataStrong(int32 Index, bool bStrong);
 
 	virtual void BeginDestroy() override;
 
+	virtual void Tick(float DeltaTime) override;
+	virtual bool IsTickable() const override;
+	virtual bool IsTickableInEditor() const override { return true; }
+	virtual bool IsTickableWhenPaused() const override { return true; }
+	virtual TStatId GetStatId() const override { RETURN_QUICK_DECLARE_CYCLE_STAT(ULuaState, STATGROUP_Tickables); }
+
+	/** Bytes lua currently has allocated in this state */
+	UFUNCTION(BlueprintPure)
+	int64 GetAllocatedBytes() const { return (int64)AllocatedBytes.load(std::memory_order_relaxed); }
+
+	/** Run collection steps for up to BudgetMicroseconds, Tick does this for states owned by the game thread */
+	UFUNCTION(BlueprintCallable)
+	LUASOURCE_API void StepGC(float BudgetMicroseconds);
+
 	UFUNCTION(BlueprintCallable)
 	LUASOURCE_API void Init();
 
@@ -290,8 +571,16 @@ public:
 	UFUNCTION(BlueprintCallable)
 	void PushUObject(UObject* Obj)
 	{
-		PushLuaUEData(Obj, Obj->GetClass(), EUEDataType::Object, nullptr);
+		PushLuaUEDataProtected(Obj, Obj->GetClass(), EUEDataType::Object);
 	}
+	/** Same as PushUObject onto L, a coroutine of this state, the getters use it to return to the thread that called them */
+	void PushUObject(lua_State* L, UObject* Obj)
+	{
+		PushLuaUEData(L, Obj, Obj->GetClass(), EUEDataType::Object, nullptr);
+	}
+	/** Push onto L a view of a struct living inside the data of the UE userdata at OwnerIndex, the view keeps that userdata alive */
+	LUASOURCE_API void PushUStructRef(lua_State* L, void* Value, UScriptStruct* Struct, int OwnerIndex);
+
 	UFUNCTION(BlueprintCallable)
 	void PushUStructDefault(UScriptStruct* Struct)
 	{
@@ -314,7 +603,11 @@ public:
 
 		P_FINISH;
 		P_NATIVE_BEGIN;
-		((ULuaState*)P_THIS)->implPushUStructCopy(StructAddr, StructProperty->Struct);
+		//StructAddr is the caller's variable rather than a temporary, so it is copied, never moved
+		if (StructProperty && StructAddr)
+		{
+			((ULuaState*)P_THIS)->implPushUStructCopy(StructAddr, StructProperty->Struct);
+		}
 		P_NATIVE_END;
 	}
 
@@ -325,6 +618,16 @@ public:
 		PushUStructCopy(&Value, T::StaticStruct());
 	}
 
+	/** Push a struct that takes over the containers and strings of Value, which is left default constructed */
+	LUASOURCE_API void PushUStructMove(void* Value, UScriptStruct* DataType);
+
+	template<typename T>
+	void PushUStructMove(T&& Value)
+	{
+		static_assert(!TIsLValueReferenceType<T>::Value, "PushUStructMove needs an rvalue, use PushUStructCopy to keep the value");
+		PushUStructMove(&Value, TRemoveReference<T>::Type::StaticStruct());
+	}
+
 
 
 
@@ -337,6 +640,8 @@ class LUASOURCE_API FLuaSourceModule : public IModuleInterface
 {
 public:
 	static FOnLuaLoadFile OnLuaLoadFile;
+	/** Preferred over OnLuaLoadFile when both are bound */
+	static FOnLuaLoadFileBytes OnLuaLoadFileBytes;
 public:
 
 	/** IModuleInterface implementation */
@@ -345,4 +650,13 @@ public:
 
 	static void* LuaMalloc(void* ud, void* ptr, size_t osize, size_t nsize);
 
+private:
+#if WITH_EDITOR
+	/** Content directories watched to invalidate the module resolution cache */
+	TMap<FString, FDelegateHandle> WatchedDirectories;
+
+	void WatchContentPath(const FString& AssetPath, const FString& FilesystemPath);
+	void UnwatchContentPath(const FString& AssetPath, const FString& FilesystemPath);
+#endif
+
 };
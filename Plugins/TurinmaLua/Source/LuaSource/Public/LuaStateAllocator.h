@@ -0,0 +1,101 @@
+// Copyright Epic Games, Inc. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+/**
+ * Allocator of one lua state. Small blocks come from per size class free lists carved out of pages owned by
+ * the allocator, larger ones go to FMemory. Lua always passes the old size back, so blocks carry no header.
+ * Not thread safe, lua only allocates while its state is entered. Destroying it releases every page at once.
+ */
+class LUASOURCE_API FLuaStateAllocator
+{
+public:
+	static constexpr SIZE_T Granularity = 16;
+	static constexpr SIZE_T MaxSmallSize = 512;
+	static constexpr SIZE_T PageSize = 16 * 1024;
+
+	FLuaStateAllocator() = default;
+	FLuaStateAllocator(const FLuaStateAllocator&) = delete;
+	FLuaStateAllocator& operator=(const FLuaStateAllocator&) = delete;
+	~FLuaStateAllocator();
+
+	/** Same contract as lua_Alloc, OldSize must be 0 when Ptr is null */
+	void* Realloc(void* Ptr, SIZE_T OldSize, SIZE_T NewSize);
+
+	/** Memory held in pages, used or not */
+	SIZE_T GetPageBytes() const { return (SIZE_T)Pages.Num() * PageSize; }
+	/** Memory of the small blocks lua currently owns, rounded up to their size class */
+	SIZE_T GetSmallUsedBytes() const { return SmallUsedBytes; }
+
+private:
+	struct FFreeBlock
+	{
+		FFreeBlock* Next;
+	};
+
+	struct FSizeClass
+	{
+		FFreeBlock* FreeList = nullptr;
+		uint8* Cursor = nullptr;
+		uint8* End = nullptr;
+	};
+
+	static constexpr int32 NumSizeClasses = MaxSmallSize / Granularity;
+
+	FSizeClass Classes[NumSizeClasses];
+	TArray<void*> Pages;
+	SIZE_T SmallUsedBytes = 0;
+
+	static int32 GetClassIndex(SIZE_T Size)
+	{
+		return (int32)((Size - 1) / Granularity);
+	}
+
+	void* AllocateSmall(int32 ClassIndex);
+	void FreeSmall(void* Ptr, int32 ClassIndex);
+};
+
+/**
+ * Parameter frames of the UFunctions lua calls. Calls nest, so frames are handed out from reusable blocks and
+ * released by rewinding to a mark. Blocks are only allocated when the calls go deeper than ever before.
+ */
+class LUASOURCE_API FLuaCallFrameStack
+{
+public:
+	static constexpr SIZE_T BlockSize = 16 * 1024;
+	static constexpr SIZE_T BlockAlignment = 64;
+
+	struct FMark
+	{
+		int32 Block;
+		SIZE_T Used;
+	};
+
+	FLuaCallFrameStack() = default;
+	FLuaCallFrameStack(const FLuaCallFrameStack&) = delete;
+	FLuaCallFrameStack& operator=(const FLuaCallFrameStack&) = delete;
+	~FLuaCallFrameStack();
+
+	FMark GetMark() const { return FMark{ Current, Used }; }
+	/** Release every frame pushed after Mark was taken */
+	void Pop(FMark Mark)
+	{
+		Current = Mark.Block;
+		Used = Mark.Used;
+	}
+	/** Uninitialized memory for one frame, Alignment may not exceed BlockAlignment */
+	void* Push(SIZE_T Size, SIZE_T Alignment);
+
+private:
+	struct FBlock
+	{
+		uint8* Data;
+		SIZE_T Size;
+	};
+
+	TArray<FBlock> Blocks;
+	int32 Current = INDEX_NONE;
+	SIZE_T Used = 0;
+};
@@ -0,0 +1,67 @@
+// Copyright Epic Games, Inc. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "lua.hpp"
+#include "UObject/Object.h"
+#include <atomic>
+#include "LuaStatePool.generated.h"
+
+class FLuaStatePoolWorker;
+
+namespace LuaJobSerializer
+{
+	/** Append the values from FirstIndex to the top of the stack, only nil, booleans, numbers, strings and trees of tables of those can cross states */
+	LUASOURCE_API bool Write(lua_State* L, int32 FirstIndex, TArray<uint8>& Out, FString& OutError);
+	/** Push every value stored in Data, returns how many were pushed or INDEX_NONE if Data is malformed */
+	LUASOURCE_API int32 Read(lua_State* L, const TArray<uint8>& Data);
+}
+
+struct FLuaStatePoolResult
+{
+	bool bSuccess = false;
+	/** The serialized return values of the job, or its error message when it failed */
+	TArray<uint8> Data;
+};
+
+/**
+ * A set of isolated lua states, each created on and pinned to its own worker thread.
+ * A job names a module and one of its functions, it runs on whichever worker has the least pending jobs.
+ * Arguments and results are serialized, so no table is ever shared between two states.
+ */
+UCLASS(BlueprintType, MinimalAPI)
+class ULuaStatePool : public UObject
+{
+	GENERATED_BODY()
+
+	friend class FLuaStatePoolWorker;
+
+	TArray<FLuaStatePoolWorker*> Workers;
+	std::atomic<int64> LastJobId = 0;
+
+	FCriticalSection CompletedLock;
+	TMap<int64, FLuaStatePoolResult> CompletedJobs;
+
+	void CompleteJob(int64 JobId, FLuaStatePoolResult&& Result);
+public:
+
+	virtual void BeginDestroy() override;
+
+	/** Start NumWorkers workers, a non positive number uses one per available worker thread */
+	UFUNCTION(BlueprintCallable)
+	LUASOURCE_API void Init(int32 NumWorkers);
+
+	/** Stop every worker, pending jobs and unclaimed results are dropped */
+	UFUNCTION(BlueprintCallable)
+	LUASOURCE_API void Finalize();
+
+	UFUNCTION(BlueprintCallable)
+	int32 GetNumWorkers() const { return Workers.Num(); }
+
+	/** Queue ModuleName.FunctionName(Args...), returns the job id or INDEX_NONE if the pool is not running */
+	LUASOURCE_API int64 Dispatch(const FString& ModuleName, const FString& FunctionName, TArray<uint8>&& Args);
+
+	/** Claim the result of a finished job, returns false while it is still pending */
+	LUASOURCE_API bool Poll(int64 JobId, FLuaStatePoolResult& OutResult);
+};